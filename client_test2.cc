@@ -10,7 +10,7 @@
 #include <cstring>
 #include <cstdio>
 #include <unistd.h>
-#include "neusc_clientsync.h"
+#include "neusc_clientshm.h"
 
 using namespace std;
 using namespace neusc;
@@ -35,7 +35,7 @@ int batch_count = sizeof(batch) / sizeof(FileBatch);
 ClientSync* client;
 
 void help(const char *t) {
-	cout << t << " -s server -p port" << endl;
+	cout << t << " -s server -p port | -u shm_path" << endl;
 	exit(1);
 }
 
@@ -87,6 +87,7 @@ void send_and_recv(int count) {
 int main(int ac, char* av[]) {
 	char server[128];
 	int port;
+	const char* shm_path = nullptr;
 	if (ac <= 1) {
 		help(av[0]);
 	}
@@ -101,14 +102,25 @@ int main(int ac, char* av[]) {
 				port = atoi(av[i]);
 			else
 				help(av[0]);
+		} else if (!strcmp(av[i], "-u")) {
+			if (++i < ac)
+				shm_path = av[i];
+			else
+				help(av[0]);
 		}
 	}
 
-	client = new ClientSync();
-	client->set_remote(server, port);
-
 	cout << "Start connecting " << endl;
-	bool is_connected = client->connect_timeout(5);
+	bool is_connected;
+	if (shm_path != nullptr) {
+		ClientShm* shm_client = new ClientShm();
+		is_connected = shm_client->connect_path(shm_path);
+		client = shm_client;
+	} else {
+		client = new ClientSync();
+		client->set_remote(server, port);
+		is_connected = client->connect_timeout(5);
+	}
 
 	if (!is_connected) {
 		cout << "connect fail" << endl;
@@ -0,0 +1,157 @@
+#include <sys/types.h>
+#include <fcntl.h>
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include "neusc_clientasync.h"
+
+using namespace std;
+using namespace neusc;
+
+#define MAXFILESIZE	(100*1024)
+struct FileBatch {
+	const char *filename;
+	char *buf;
+	size_t size;
+} batch [] = {
+	{ .filename = "neusc_server.h" },
+	{ .filename = "neusc_server.cc" },
+	{ .filename = "neusc_clientsync.h" },
+	{ .filename = "neusc_clientsync.cc" }
+};
+
+int batch_count = sizeof(batch) / sizeof(FileBatch);
+
+void help(const char *t) {
+	cout << t << " -s server -p port [-c connections] [-n rounds] [-i]" << endl;
+	cout << "	-i: request id mode, server must set REQUEST_ID" << endl;
+	exit(1);
+}
+
+void read_file(int index) {
+	const char* filename = batch[index].filename;
+	batch[index].buf = new char[MAXFILESIZE];
+	batch[index].size = 0;
+	int fd = open(filename,  O_RDONLY);
+	if (fd < 0) {
+		cout << "cannot open file: " << filename << endl;
+		return;
+	}
+	batch[index].buf[0] = index;
+	batch[index].size = read(fd, batch[index].buf + 1, MAXFILESIZE-1) + 1;
+	close(fd);
+}
+
+/* the first byte of response tells which file it is */
+bool check_reply(const char* data, unsigned int length) {
+	int idx = data[0];
+	if (idx < 0 || idx >= batch_count || length != batch[idx].size ||
+			memcmp(data, batch[idx].buf, length)) {
+		cout << "DIFFERENT: recv:" << length << endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int ac, char* av[]) {
+	char server[128];
+	int port = 0;
+	int conn_count = 4;
+	int rounds = 100;
+	bool request_id = false;
+	if (ac <= 1) {
+		help(av[0]);
+	}
+	for (int i = 1; i < ac; i++) {
+		if (!strcmp(av[i], "-s")) {
+			if (++i < ac)
+				strcpy(server, av[i]);
+			else
+				help(av[0]);
+		} else if (!strcmp(av[i], "-p")) {
+			if (++i < ac)
+				port = atoi(av[i]);
+			else
+				help(av[0]);
+		} else if (!strcmp(av[i], "-c")) {
+			if (++i < ac)
+				conn_count = atoi(av[i]);
+			else
+				help(av[0]);
+		} else if (!strcmp(av[i], "-i")) {
+			request_id = true;
+		} else if (!strcmp(av[i], "-n")) {
+			if (++i < ac)
+				rounds = atoi(av[i]);
+			else
+				help(av[0]);
+		}
+	}
+
+	for (int i = 0; i < batch_count; i++) {
+		read_file(i);
+	}
+
+	/* responses are matched in sending order,
+		server should set RESPONSE_ORDERLY, or REQUEST_ID with -i
+	*/
+	ClientAsync* client = new ClientAsync();
+	client->set_max_inflight(16);
+	client->set_request_id(request_id);
+	client->start();
+
+	vector<int> conns;
+	for (int i = 0; i < conn_count; i++) {
+		int conn = client->connect(server, port, 5, [](int conn, bool ok) {
+			cout << "connection " << conn << (ok ? " established" : " fail") << endl;
+		});
+		if (conn < 0) {
+			cout << "cannot resolve " << server << endl;
+			exit(1);
+		}
+		conns.push_back(conn);
+	}
+
+	/* callback style: all rounds are pipelined on every connection */
+	std::atomic<int> ok_count(0), fail_count(0);
+	for (int r = 0; r < rounds; r++) {
+		for (size_t c = 0; c < conns.size(); c++) {
+			for (int i = 0; i < batch_count; i++) {
+				client->submit(conns[c], batch[i].buf, batch[i].size,
+						[&](bool ok, const char* data, unsigned int length) {
+					if (ok && check_reply(data, length))
+						ok_count++;
+					else
+						fail_count++;
+				});
+			}
+		}
+	}
+	while (client->pending_count() > 0)
+		usleep(1000);
+	cout << "callback recv: " << ok_count << " fail: " << fail_count << endl;
+
+	/* future style */
+	vector<future<string>> futures;
+	for (int i = 0; i < batch_count; i++)
+		futures.push_back(client->submit(conns[0], batch[i].buf, batch[i].size));
+	for (int i = 0; i < batch_count; i++) {
+		try {
+			string reply = futures[i].get();
+			check_reply(reply.data(), reply.size());
+			cout << "future recv: " << reply.size() << endl;
+		} catch (std::exception& e) {
+			cout << "future fail: " << e.what() << endl;
+		}
+	}
+
+	delete client;
+	for (int i = 0; i < batch_count; i++) {
+		delete[] batch[i].buf;
+	}
+	return fail_count > 0 ? 1 : 0;
+}
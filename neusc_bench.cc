@@ -0,0 +1,403 @@
+#include <time.h>
+#include <unistd.h>
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+#include "neusc_server.h"
+#include "neusc_clientasync.h"
+#include "neusc_histogram.h"
+
+using namespace std;
+using namespace neusc;
+
+/* neusc_bench is the load generator and the matching benchmark server.
+ * client mode keeps depth requests on the wire of every connection
+ * (closed loop), or sends at a fixed total rate (open loop) and measures
+ * latency from the time a request should have been sent, so a stalled
+ * server is not hidden by the client waiting for it.
+*/
+
+void help(const char *t) {
+	cout << "server: " << t << " -S -p port [-w work_threads] [-i io_threads] [-u] [-r] [-a] [-I]" << endl;
+	cout << "		[-C cost_us] [-z response_bytes] [-m seconds] [-N] [-b backlog]" << endl;
+	cout << "client: " << t << " -s server -p port [-c connections] [-t threads] [-d depth]" << endl;
+	cout << "		[-l payload] [-D seconds] [-R rate] [-r]" << endl;
+	cout << "	-u: io_uring backend" << endl;
+	cout << "	-a: hash connections to work threads, WORKER_AFFINITY" << endl;
+	cout << "	-I: handle requests in I/O threads, INLINE_REQUEST" << endl;
+	cout << "	-r: request id mode on both sides, otherwise server sets RESPONSE_ORDERLY" << endl;
+	cout << "	-C: busy time of handler per request, in microseconds" << endl;
+	cout << "	-z: response size, 0 echoes the request" << endl;
+	cout << "	-m: time stages of requests, print server metrics every seconds" << endl;
+	cout << "	-N: TCP_NODELAY on the connections of server" << endl;
+	cout << "	-b: listen backlog of server, default 1024" << endl;
+	cout << "	-c: connections in total, default 16" << endl;
+	cout << "	-t: client event loops, connections are spread over them, default 1" << endl;
+	cout << "	-d: max requests on the wire per connection, default 1" << endl;
+	cout << "	-l: payload bytes, N | MIN-MAX (uniform) | expN (exponential, mean N), default 64" << endl;
+	cout << "	-D: duration, default 10" << endl;
+	cout << "	-R: requests per second in total, open loop, default 0 is closed loop" << endl;
+	exit(1);
+}
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline) {
+	struct timespec ts;
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+		;
+}
+
+/* ---------------- server mode ---------------- */
+
+int run_server(int port, int work_threads, int io_threads, bool uring,
+		bool affinity, bool inline_request, bool request_id, int cost_us, int response_size, int metrics_interval,
+		const SocketOptions& socket_options) {
+	Server *server = new Server();
+	server->set_socket_options(socket_options);
+	if (work_threads > 0)
+		server->set_work_thread_count(work_threads);
+	server->set_io_thread_count(io_threads);
+	if (uring)
+		server->set_io_backend(Server::IO_URING);
+	server->set_config_on(request_id ? Server::REQUEST_ID : Server::RESPONSE_ORDERLY);
+	if (affinity)
+		server->set_config_on(Server::WORKER_AFFINITY);
+	if (inline_request)
+		server->set_config_on(Server::INLINE_REQUEST);
+
+	vector<char> reply(response_size > 0 ? response_size : 1, 'r');
+	uint64_t cost_ns = cost_us * 1000ULL;
+	ServerEvents events;
+	events.onRequest = [&reply, cost_ns, response_size](Request* request) -> bool {
+		if (cost_ns > 0) {
+			uint64_t until = now_ns() + cost_ns;
+			while (now_ns() < until)
+				;
+		}
+		if (response_size > 0)
+			request->clone_response(response_size, reply.data());
+		else if (request->get_size() > 0)
+			request->clone_response(request->get_size(), request->get_ptr());
+		else
+			request->clone_response(1, reply.data());
+		request->end_response();
+		return true;
+	};
+	/* metrics are read by another thread while the server runs */
+	std::atomic<bool> ended(false);
+	std::thread* exporter = nullptr;
+	if (metrics_interval > 0) {
+		server->set_config_on(Server::STAGE_METRICS);
+		exporter = new std::thread([&] {
+			uint64_t next = now_ns();
+			while (!ended) {
+				next += metrics_interval * 1000000000ULL;
+				while (!ended && now_ns() < next)
+					usleep(100 * 1000);
+				if (!ended)
+					cout << server->get_metrics().to_text() << endl;
+			}
+		});
+	}
+	cout << "bench server on port " << port << ", handler cost " << cost_us << "us" << endl;
+	int ret = server->ready(port, events);
+	ended = true;
+	if (exporter) {
+		exporter->join();
+		delete exporter;
+		cout << server->get_metrics().to_text();
+	}
+	delete server;
+	return ret;
+}
+
+/* ---------------- client mode ---------------- */
+
+/* payload size distribution, sizes are drawn up front into a table */
+struct Payload {
+	enum { FIXED, UNIFORM, EXPONENTIAL } kind;
+	unsigned int a;
+	unsigned int b;
+
+	bool parse(const char* s) {
+		if (!strncmp(s, "exp", 3)) {
+			kind = EXPONENTIAL;
+			a = atoi(s + 3);
+			return a > 0;
+		}
+		const char* dash = strchr(s, '-');
+		a = atoi(s);
+		if (dash) {
+			kind = UNIFORM;
+			b = atoi(dash + 1);
+			return a > 0 && b >= a;
+		}
+		kind = FIXED;
+		return a > 0;
+	}
+	unsigned int max_size() const {
+		return kind == FIXED ? a : (kind == UNIFORM ? b : a * 8);
+	}
+	vector<unsigned int> table(size_t count) const {
+		vector<unsigned int> sizes(count);
+		mt19937 random(12345);
+		uniform_int_distribution<unsigned int> uniform(a, kind == UNIFORM ? b : a);
+		exponential_distribution<double> exponential(1.0 / a);
+		for (size_t i = 0; i < count; i++) {
+			if (kind == EXPONENTIAL) {
+				double v = ceil(exponential(random));
+				sizes[i] = (unsigned int)std::max(1.0, std::min(v, (double)max_size()));
+			} else
+				sizes[i] = uniform(random);
+		}
+		return sizes;
+	}
+};
+
+/* one ClientAsync loop with its share of connections, the histogram and
+ * counters are only touched by the loop thread in callbacks
+*/
+struct Worker {
+	ClientAsync client;
+	vector<int> conns;
+	const vector<unsigned int>* sizes;
+	const char* payload;
+	std::atomic<unsigned int> next_size;
+	bool closed_loop;
+	const std::atomic<bool>* stopping;
+	uint64_t end_ns;
+
+	Histogram histogram;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t late;
+	std::thread* pacer;
+
+	Worker() : next_size(0), bytes(0), errors(0), late(0), pacer(nullptr) {}
+
+	/* start_ns is when the request is meant to go out */
+	void send(int conn, uint64_t start_ns) {
+		unsigned int size = (*sizes)[next_size.fetch_add(1) % sizes->size()];
+		client.submit(conn, payload, size,
+				[this, conn, start_ns](bool ok, const char* data, unsigned int length) {
+			this->reply(conn, start_ns, ok, length);
+		});
+	}
+
+	void reply(int conn, uint64_t start_ns, bool ok, unsigned int length) {
+		uint64_t now = now_ns();
+		if (now > end_ns) {
+			late++;
+			return;
+		}
+		if (ok) {
+			histogram.record(now - start_ns);
+			bytes += length;
+		} else
+			errors++;
+		if (closed_loop && !stopping->load())
+			send(conn, now);
+	}
+
+	/* open loop, requests are spread over connections in turn */
+	void pace(uint64_t start_ns, double rate) {
+		double interval = 1e9 / rate;
+		size_t c = 0;
+		for (uint64_t n = 0; !stopping->load(); n++) {
+			uint64_t at = start_ns + (uint64_t)(n * interval);
+			if (at >= end_ns)
+				break;
+			if (at > now_ns())
+				sleep_until_ns(at);
+			send(conns[c++ % conns.size()], at);
+		}
+	}
+};
+
+int run_client(const char* server, int port, int conn_count, int thread_count,
+		int depth, const Payload& payload, int duration, double rate, bool request_id) {
+	vector<char> data(payload.max_size(), 'x');
+	vector<unsigned int> sizes = payload.table(64 * 1024);
+	std::atomic<bool> stopping(false);
+	std::atomic<int> connected(0), failed(0);
+
+	vector<Worker*> workers;
+	for (int t = 0; t < thread_count; t++) {
+		Worker* w = new Worker();
+		w->sizes = &sizes;
+		w->payload = data.data();
+		w->closed_loop = rate <= 0;
+		w->stopping = &stopping;
+		w->end_ns = UINT64_MAX;
+		w->client.set_max_inflight(depth);
+		w->client.set_request_id(request_id);
+		w->client.start();
+		workers.push_back(w);
+	}
+	for (int i = 0; i < conn_count; i++) {
+		Worker* w = workers[i % thread_count];
+		int conn = w->client.connect(server, port, 5, [&](int conn, bool ok) {
+			if (ok)
+				connected++;
+			else
+				failed++;
+		});
+		if (conn < 0) {
+			cout << "cannot resolve " << server << endl;
+			exit(1);
+		}
+		w->conns.push_back(conn);
+	}
+	while (connected + failed < conn_count)
+		usleep(1000);
+	if (failed > 0) {
+		cout << failed << " connections fail" << endl;
+		exit(1);
+	}
+
+	uint64_t start_ns = now_ns();
+	uint64_t end_ns = start_ns + duration * 1000000000ULL;
+	for (size_t t = 0; t < workers.size(); t++) {
+		Worker* w = workers[t];
+		w->end_ns = end_ns;
+		if (w->closed_loop) {
+			for (size_t c = 0; c < w->conns.size(); c++)
+				for (int d = 0; d < depth; d++)
+					w->send(w->conns[c], now_ns());
+		} else if (!w->conns.empty()) {
+			w->pacer = new std::thread(&Worker::pace, w, start_ns, rate / thread_count);
+		}
+	}
+
+	sleep_until_ns(end_ns);
+	stopping = true;
+
+	Histogram histogram;
+	uint64_t bytes = 0, errors = 0, late = 0;
+	for (size_t t = 0; t < workers.size(); t++) {
+		Worker* w = workers[t];
+		if (w->pacer) {
+			w->pacer->join();
+			delete w->pacer;
+		}
+		/* give requests on the wire a moment, then fail the rest */
+		for (int i = 0; i < 1000 && w->client.pending_count() > 0; i++)
+			usleep(1000);
+		w->client.stop();
+		histogram.merge(w->histogram);
+		bytes += w->bytes;
+		errors += w->errors;
+		late += w->late;
+		delete w;
+	}
+
+	double seconds = duration;
+	printf("connections %d threads %d depth %d duration %ds ",
+			conn_count, thread_count, depth, duration);
+	if (rate > 0)
+		printf("open loop rate %.0f/s\n", rate);
+	else
+		printf("closed loop\n");
+	printf("requests %lu errors %lu after end %lu\n", (unsigned long)histogram.count(),
+			(unsigned long)errors, (unsigned long)late);
+	printf("throughput %.1f req/s %.2f MB/s\n", histogram.count() / seconds,
+			bytes / seconds / (1024 * 1024));
+	printf("latency(us) %s\n", histogram.summary(1000).c_str());
+	return errors > 0 ? 1 : 0;
+}
+
+int main(int ac, char* av[]) {
+	bool server_mode = false;
+	char server[128] = "127.0.0.1";
+	int port = 0;
+	int work_threads = 0, io_threads = 1, cost_us = 0, response_size = 0;
+	int metrics_interval = 0;
+	bool uring = false, affinity = false, inline_request = false, request_id = false;
+	int conn_count = 16, thread_count = 1, depth = 1, duration = 10;
+	double rate = 0;
+	SocketOptions socket_options;
+	Payload payload;
+	payload.parse("64");
+
+	if (ac <= 1) {
+		help(av[0]);
+	}
+	for (int i = 1; i < ac; i++) {
+		const char* opt = av[i];
+		/* options without value */
+		if (!strcmp(opt, "-S")) {
+			server_mode = true;
+			continue;
+		} else if (!strcmp(opt, "-u")) {
+			uring = true;
+			continue;
+		} else if (!strcmp(opt, "-r")) {
+			request_id = true;
+			continue;
+		} else if (!strcmp(opt, "-a")) {
+			affinity = true;
+			continue;
+		} else if (!strcmp(opt, "-I")) {
+			inline_request = true;
+			continue;
+		} else if (!strcmp(opt, "-N")) {
+			socket_options.tcp_nodelay = true;
+			continue;
+		}
+		if (++i >= ac)
+			help(av[0]);
+		const char* value = av[i];
+		if (!strcmp(opt, "-s")) {
+			snprintf(server, sizeof(server), "%s", value);
+		} else if (!strcmp(opt, "-p")) {
+			port = atoi(value);
+		} else if (!strcmp(opt, "-w")) {
+			work_threads = atoi(value);
+		} else if (!strcmp(opt, "-i")) {
+			io_threads = atoi(value);
+		} else if (!strcmp(opt, "-C")) {
+			cost_us = atoi(value);
+		} else if (!strcmp(opt, "-z")) {
+			response_size = atoi(value);
+		} else if (!strcmp(opt, "-m")) {
+			metrics_interval = atoi(value);
+		} else if (!strcmp(opt, "-c")) {
+			conn_count = atoi(value);
+		} else if (!strcmp(opt, "-t")) {
+			thread_count = atoi(value);
+		} else if (!strcmp(opt, "-d")) {
+			depth = atoi(value);
+		} else if (!strcmp(opt, "-l")) {
+			if (!payload.parse(value))
+				help(av[0]);
+		} else if (!strcmp(opt, "-D")) {
+			duration = atoi(value);
+		} else if (!strcmp(opt, "-R")) {
+			rate = atof(value);
+		} else if (!strcmp(opt, "-b")) {
+			socket_options.backlog = atoi(value);
+		} else
+			help(av[0]);
+	}
+	if (port <= 0 || conn_count <= 0 || thread_count <= 0 || depth <= 0 || duration <= 0)
+		help(av[0]);
+
+	if (server_mode)
+		return run_server(port, work_threads, io_threads, uring, affinity, inline_request, request_id,
+				cost_us, response_size, metrics_interval, socket_options);
+	return run_client(server, port, conn_count, thread_count, depth, payload,
+			duration, rate, request_id);
+}
@@ -0,0 +1,466 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <cassert>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <algorithm>
+#include "neusc_clientasync.h"
+
+using namespace neusc;
+
+ClientAsync::ClientAsync() : max_inflight(128), batch_bytes(256 * 1024),
+		request_id_on(false),
+		next_id(0), pending(0), running(false), thread(nullptr) {
+	signal(SIGPIPE, SIG_IGN);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event ev;
+	ev.data.u64 = WAKE_KEY;
+	ev.events = EPOLLIN;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+}
+
+ClientAsync::~ClientAsync() {
+	stop();
+	::close(wake_fd);
+	::close(epoll_fd);
+}
+
+long ClientAsync::now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+bool ClientAsync::start() {
+	if (running.exchange(true))
+		return false;
+	thread = new std::thread([this] {
+		while (this->running.load())
+			this->poll(100);
+	});
+	return true;
+}
+
+void ClientAsync::stop() {
+	if (running.exchange(false)) {
+		uint64_t one = 1;
+		if (::write(wake_fd, &one, sizeof(one)) < 0)
+			perror("eventfd write");
+		thread->join();
+		delete thread;
+		thread = nullptr;
+	}
+	/* loop thread has gone, fail everything left in caller's thread */
+	run_commands();
+	while (!connection_map.empty())
+		close_connection(connection_map.begin()->second, false);
+}
+
+int ClientAsync::connect(const char* name, int port, int timeout,
+		ConnectCallback on_connected) {
+	Command command;
+	memset(&command.address, 0, sizeof(command.address));
+	command.address.sin_family = AF_INET;
+	command.address.sin_port = htons(port);
+	if (inet_pton(AF_INET, name, &command.address.sin_addr) != 1) {
+		/* dns */
+		struct addrinfo hints, *result;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(name, nullptr, &hints, &result) != 0)
+			return -1;
+		command.address.sin_addr = ((struct sockaddr_in*)result->ai_addr)->sin_addr;
+		freeaddrinfo(result);
+	}
+	command.type = Command::CONNECT;
+	command.conn = next_id++;
+	command.outgoing = nullptr;
+	command.timeout = timeout;
+	command.on_connected = on_connected;
+	post(command);
+	return command.conn;
+}
+
+void ClientAsync::disconnect(int conn) {
+	Command command;
+	command.type = Command::DISCONNECT;
+	command.conn = conn;
+	command.outgoing = nullptr;
+	post(command);
+}
+
+void ClientAsync::submit(int conn, const char* data, unsigned int length,
+		Callback callback) {
+	size_t header = header_size();
+	/* the frame size must not wrap, fail the request instead */
+	if (length > UINT32_MAX - header) {
+		if (callback)
+			callback(false, nullptr, 0);
+		return;
+	}
+	Outgoing* outgoing = new Outgoing;
+	outgoing->frame = (char*)Pool::alloc((size_t)length + header, outgoing->frame_size);
+	outgoing->frame_size = (size_t)length + header;
+	outgoing->written = 0;
+	outgoing->id = 0;
+	outgoing->callback = callback;
+	unsigned char* len = (unsigned char*)outgoing->frame;
+	len[0] = length >> 24;
+	len[1] = (length & 0xFF0000U) >> 16;
+	len[2] = (length & 0xFF00U) >> 8;
+	len[3] = (length & 0xFFU);
+	memcpy(outgoing->frame + header, data, length);
+	pending++;
+
+	Command command;
+	command.type = Command::SUBMIT;
+	command.conn = conn;
+	command.outgoing = outgoing;
+	post(command);
+}
+
+std::future<std::string> ClientAsync::submit(int conn, const char* data,
+		unsigned int length) {
+	std::shared_ptr<std::promise<std::string>> promise =
+		std::make_shared<std::promise<std::string>>();
+	std::future<std::string> future = promise->get_future();
+	submit(conn, data, length, [promise](bool ok, const char* data, unsigned int length) {
+		if (ok)
+			promise->set_value(std::string(data, length));
+		else
+			promise->set_exception(std::make_exception_ptr(
+					std::runtime_error("neusc request failed")));
+	});
+	return future;
+}
+
+/*
+ * called from any thread, queue the command for loop thread,
+ * the eventfd is only written when the queue was empty
+*/
+void ClientAsync::post(const Command& command) {
+	bool was_empty;
+	command_mutex.lock();
+	was_empty = commands.empty();
+	commands.push_back(command);
+	command_mutex.unlock();
+	if (was_empty) {
+		uint64_t one = 1;
+		if (::write(wake_fd, &one, sizeof(one)) < 0)
+			perror("eventfd write");
+	}
+}
+
+void ClientAsync::run_commands() {
+	std::vector<Command> todo;
+	command_mutex.lock();
+	todo.swap(commands);
+	command_mutex.unlock();
+
+	std::unordered_map<int,Connection*>::iterator it;
+	for (size_t i = 0; i < todo.size(); i++) {
+		Command& command = todo[i];
+		switch (command.type) {
+		case Command::CONNECT:
+			open_connection(command);
+			break;
+		case Command::SUBMIT:
+			it = connection_map.find(command.conn);
+			if (it == connection_map.end()) {
+				release_outgoing(command.outgoing, false);
+				break;
+			}
+			if (request_id_on) {
+				/* request id is unique in its connection */
+				unsigned int id = it->second->next_id++;
+				unsigned char* p = (unsigned char*)command.outgoing->frame + 4;
+				p[0] = id >> 24;
+				p[1] = (id & 0xFF0000U) >> 16;
+				p[2] = (id & 0xFF00U) >> 8;
+				p[3] = (id & 0xFFU);
+				command.outgoing->id = id;
+			}
+			it->second->queued.push_back(command.outgoing);
+			if (it->second->connected)
+				flush(it->second);
+			break;
+		case Command::DISCONNECT:
+			it = connection_map.find(command.conn);
+			if (it != connection_map.end())
+				close_connection(it->second, false);
+			break;
+		}
+	}
+}
+
+void ClientAsync::open_connection(const Command& command) {
+	int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		if (command.on_connected)
+			command.on_connected(command.conn, false);
+		return;
+	}
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	Connection* connection = new Connection;
+	connection->id = command.conn;
+	connection->fd = fd;
+	connection->connected = false;
+	connection->deadline_ms = now_ms() + command.timeout * 1000L;
+	connection->on_connected = command.on_connected;
+	connection->next_id = 0;
+	connection->header_has_read = 0;
+	connection->body = nullptr;
+	connection->body_capacity = 0;
+	connection->body_has_read = 0;
+	connection_map[connection->id] = connection;
+
+	if (::connect(fd, (struct sockaddr*)&command.address, sizeof(command.address)) < 0 &&
+			errno != EINPROGRESS) {
+		close_connection(connection, false);
+		return;
+	}
+	struct epoll_event ev;
+	ev.data.u64 = (uint32_t)connection->id;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * fail all requests of the connection and release it,
+ * on_connected is called with false if it has not connected
+*/
+void ClientAsync::close_connection(Connection* connection, bool ok) {
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+	::close(connection->fd);
+	connection_map.erase(connection->id);
+	if (!connection->connected && connection->on_connected)
+		connection->on_connected(connection->id, false);
+
+	std::deque<Outgoing*>* lists[] = {
+		&connection->waiting, &connection->sending, &connection->queued
+	};
+	for (int i = 0; i < 3; i++) {
+		std::for_each(lists[i]->begin(), lists[i]->end(), [this, ok](Outgoing* o) {
+			this->release_outgoing(o, ok);
+		});
+	}
+	std::for_each(connection->waiting_ids.begin(), connection->waiting_ids.end(), 
+			[this, ok](std::pair<const unsigned int,Outgoing*>& p) {
+		this->release_outgoing(p.second, ok);
+	});
+	if (connection->body)
+		Pool::free(connection->body, connection->body_capacity);
+	delete connection;
+}
+
+void ClientAsync::release_outgoing(Outgoing* outgoing, bool ok) {
+	if (!ok && outgoing->callback)
+		outgoing->callback(false, nullptr, 0);
+	Pool::free(outgoing->frame, outgoing->frame_size);
+	delete outgoing;
+	pending--;
+}
+
+/*
+ * move queued requests to the wire while inflight is under max_inflight,
+ * and write them out in batch by writev until EAGAIN,
+ * return false if the connection has been closed
+*/
+bool ClientAsync::flush(Connection* connection) {
+	struct iovec iov[IOVSIZE];
+	while (true) {
+		while (!connection->queued.empty() && (int)inflight(connection) < max_inflight) {
+			connection->sending.push_back(connection->queued.front());
+			connection->queued.pop_front();
+		}
+		int count = 0;
+		size_t bytes = 0;
+		for (size_t i = 0; i < connection->sending.size() && count < IOVSIZE &&
+				bytes < batch_bytes; i++) {
+			Outgoing* o = connection->sending[i];
+			iov[count].iov_base = o->frame + o->written;
+			iov[count].iov_len = o->frame_size - o->written;
+			bytes += iov[count].iov_len;
+			count++;
+		}
+		if (count == 0)
+			return true;
+		ssize_t write_num = writev(connection->fd, iov, count);
+		if (write_num < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			close_connection(connection, false);
+			return false;
+		}
+		size_t remain = write_num;
+		while (!connection->sending.empty()) {
+			Outgoing* o = connection->sending.front();
+			size_t n = std::min(remain, o->frame_size - o->written);
+			o->written += n;
+			remain -= n;
+			if (o->written < o->frame_size)
+				break;
+			connection->sending.pop_front();
+			if (request_id_on)
+				connection->waiting_ids[o->id] = o;
+			else
+				connection->waiting.push_back(o);
+		}
+	}
+}
+
+/*
+ * called when one response is complete, it belongs to the first
+ * request waiting on the connection, or the request of the echoed id
+*/
+bool ClientAsync::complete(Connection* connection) {
+	Outgoing* outgoing;
+	if (request_id_on) {
+		unsigned char* p = connection->header_buf + 4;
+		unsigned int id = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		std::unordered_map<unsigned int,Outgoing*>::iterator it = 
+			connection->waiting_ids.find(id);
+		if (it == connection->waiting_ids.end())
+			return false;
+		outgoing = it->second;
+		connection->waiting_ids.erase(it);
+	} else {
+		if (connection->waiting.empty())
+			return false;
+		outgoing = connection->waiting.front();
+		connection->waiting.pop_front();
+	}
+	if (outgoing->callback)
+		outgoing->callback(true, connection->body, connection->body_has_read);
+	release_outgoing(outgoing, true);
+	connection->header_has_read = 0;
+	connection->body_has_read = 0;
+	return true;
+}
+
+/*
+ * read responses until EAGAIN, return false if the connection has been closed
+*/
+bool ClientAsync::receive(Connection* connection) {
+	while (true) {
+		int num_read = ::read(connection->fd, buffer, BUFFERSIZE);
+		if (num_read < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			close_connection(connection, false);
+			return false;
+		} else if (num_read == 0) {
+			close_connection(connection, false);
+			return false;
+		}
+		const char* src = buffer;
+		int header = header_size();
+		while (num_read > 0 || connection->header_has_read == header) {
+			unsigned char* len = connection->header_buf;
+			if (connection->header_has_read < header) {
+				int n = std::min(num_read, header - connection->header_has_read);
+				memcpy(connection->header_buf + connection->header_has_read, src, n);
+				connection->header_has_read += n;
+				src += n;
+				num_read -= n;
+				if (connection->header_has_read < header)
+					break;
+				unsigned int length = (len[0] << 24) | (len[1] << 16) | (len[2] << 8) | len[3];
+				if (length > connection->body_capacity) {
+					if (connection->body)
+						Pool::free(connection->body, connection->body_capacity);
+					connection->body = (char*)Pool::alloc(length, connection->body_capacity);
+				}
+			}
+			unsigned int length = (len[0] << 24) | (len[1] << 16) | (len[2] << 8) | len[3];
+			unsigned int n = std::min((unsigned int)num_read, length - connection->body_has_read);
+			memcpy(connection->body + connection->body_has_read, src, n);
+			connection->body_has_read += n;
+			src += n;
+			num_read -= n;
+			if (connection->body_has_read < length)
+				break;
+			if (!complete(connection)) {
+				/* response without request */
+				close_connection(connection, false);
+				return false;
+			}
+		}
+	}
+}
+
+void ClientAsync::check_timeout() {
+	long now = now_ms();
+	std::vector<Connection*> expired;
+	std::for_each(connection_map.begin(), connection_map.end(),
+			[&expired, now](std::pair<const int,Connection*>& p) {
+		if (!p.second->connected && p.second->deadline_ms < now)
+			expired.push_back(p.second);
+	});
+	std::for_each(expired.begin(), expired.end(), [this](Connection* c) {
+		this->close_connection(c, false);
+	});
+}
+
+void ClientAsync::poll(int timeout_ms) {
+	int nfds = epoll_wait(epoll_fd, events, EVENTSIZE, timeout_ms);
+	for (int i = 0; i < nfds; i++) {
+		uint64_t key = events[i].data.u64;
+		if (key == WAKE_KEY) {
+			uint64_t count;
+			if (::read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				perror("eventfd read");
+			run_commands();
+			continue;
+		}
+		/* closed by a command or a failed flush earlier in this batch */
+		std::unordered_map<int,Connection*>::iterator it = connection_map.find((int)key);
+		if (it == connection_map.end())
+			continue;
+		Connection* connection = it->second;
+		if (!connection->connected) {
+			int error = 0;
+			socklen_t len = sizeof(error);
+			getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+			if (error != 0 || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+				close_connection(connection, false);
+				continue;
+			}
+			connection->connected = true;
+			if (connection->on_connected)
+				connection->on_connected(connection->id, true);
+			if (!flush(connection))
+				continue;
+		} else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+			close_connection(connection, false);
+			continue;
+		}
+		if ((events[i].events & EPOLLIN) && !receive(connection))
+			continue;
+		/* responses make room for queued requests */
+		flush(connection);
+	}
+	check_timeout();
+}
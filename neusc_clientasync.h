@@ -0,0 +1,170 @@
+#ifndef __NEUSC_CLIENTASYNC_H_
+#define __NEUSC_CLIENTASYNC_H_
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <functional>
+#include <future>
+#include <string>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include "neusc_pool.h"
+
+namespace neusc {
+
+/* ClientAsync drives many non-blocking connections from one epoll thread.
+ * requests are framed with the same 4 bytes big-endian length as Server,
+ * every connection keeps at most max_inflight requests on the wire, and
+ * queued requests are batched into one writev.
+ * responses are matched to requests in sending order, so the server must
+ * set RESPONSE_ORDERLY, or both sides set request id mode, then responses
+ * are matched by the request id echoed back, in any order.
+ *
+ * the event loop runs in its own thread after start(), or in the caller's
+ * thread by calling poll(). callbacks are always called in the loop thread.
+*/
+class ClientAsync {
+public:
+	/* ok is false if the connection failed before the response came back */
+	typedef std::function<void(bool ok, const char* data, unsigned int length)> Callback;
+	typedef std::function<void(int conn, bool ok)> ConnectCallback;
+
+	ClientAsync();
+	~ClientAsync();
+
+	/* max requests sent but not responsed of one connection, default 128 */
+	void set_max_inflight(int n) { max_inflight = n > 0 ? n : 1; }
+	/* bytes gathered into one writev, default 256K */
+	void set_batch_bytes(size_t n) { batch_bytes = n; }
+	/* frames carry request id, server must set REQUEST_ID, 
+	 * must be set before any connect
+	*/
+	void set_request_id(bool on) { request_id_on = on; }
+
+	/* start event loop thread */
+	bool start();
+	/* stop event loop thread, fail all requests left */
+	void stop();
+	/* run one round of event loop in caller's thread */
+	void poll(int timeout_ms);
+
+	/* return connection id, or -1 if name can't be resolved.
+	 * connecting is asynchronous, requests submitted before connected are
+	 * queued. on_connected is called in loop thread.
+	*/
+	int connect(const char* name, int port, int timeout,
+			ConnectCallback on_connected = nullptr);
+	void disconnect(int conn);
+
+	/* thread safe, copy data and queue it to the connection. a request
+	 *	too long for the frame header fails at once in caller's thread
+	*/
+	void submit(int conn, const char* data, unsigned int length, Callback callback);
+	void submit(int conn, const std::string& msg, Callback callback) {
+		submit(conn, msg.data(), msg.size(), callback);
+	}
+	/* the future throws std::runtime_error if the request failed */
+	std::future<std::string> submit(int conn, const char* data, unsigned int length);
+	std::future<std::string> submit(int conn, const std::string& msg) {
+		return submit(conn, msg.data(), msg.size());
+	}
+
+	/* requests submitted but not completed, over all connections */
+	size_t pending_count() const { return pending.load(); }
+
+protected:
+	struct Outgoing {
+		/* length header and body in one buffer from Pool */
+		char* frame;
+		size_t frame_size;
+		size_t written;
+		unsigned int id;
+		Callback callback;
+	};
+	struct Command {
+		enum { CONNECT, SUBMIT, DISCONNECT } type;
+		int conn;
+		Outgoing* outgoing;
+		struct sockaddr_in address;
+		int timeout;
+		ConnectCallback on_connected;
+	};
+	struct Connection {
+		int id;
+		int fd;
+		bool connected;
+		long deadline_ms;
+		ConnectCallback on_connected;
+		/* submitted but not written out */
+		std::deque<Outgoing*> queued;
+		/* on the wire, written or partial written */
+		std::deque<Outgoing*> sending;
+		/* written completely, waiting for response */
+		std::deque<Outgoing*> waiting;
+		/* waiting for response by request id, on request id mode */
+		std::unordered_map<unsigned int,Outgoing*> waiting_ids;
+		unsigned int next_id;
+		/* response reading */
+		unsigned char header_buf[8];
+		int header_has_read;
+		char* body;
+		size_t body_capacity;
+		unsigned int body_has_read;
+	};
+
+	void post(const Command& command);
+	void run_commands();
+	void open_connection(const Command& command);
+	void close_connection(Connection* connection, bool ok);
+	bool flush(Connection* connection);
+	bool receive(Connection* connection);
+	/* return false if no request matches the response */
+	bool complete(Connection* connection);
+	size_t inflight(Connection* connection) const {
+		return connection->sending.size() + connection->waiting.size() + 
+			connection->waiting_ids.size();
+	}
+	int header_size() const { return request_id_on ? 8 : 4; }
+	void check_timeout();
+	void release_outgoing(Outgoing* outgoing, bool ok);
+	static long now_ms();
+
+	constexpr static const int EVENTSIZE = 256;
+	constexpr static const int BUFFERSIZE = 64 * 1024;
+	constexpr static const int IOVSIZE = 64;
+	/* epoll data of wake_fd, a connection is keyed by its id, which is
+	 *	never reused, so an event of a connection closed earlier in the
+	 *	same batch finds nothing
+	*/
+	constexpr static const uint64_t WAKE_KEY = UINT64_MAX;
+
+	int epoll_fd;
+	int wake_fd;
+	int max_inflight;
+	size_t batch_bytes;
+	bool request_id_on;
+	std::atomic<int> next_id;
+	std::atomic<size_t> pending;
+	std::atomic<bool> running;
+	std::thread* thread;
+
+	std::mutex command_mutex;
+	std::vector<Command> commands;
+
+	/* only touched by loop thread */
+	std::unordered_map<int,Connection*> connection_map;
+	struct epoll_event events[EVENTSIZE];
+	char buffer[BUFFERSIZE];
+};
+
+} // namespace neusc
+
+#endif
@@ -0,0 +1,123 @@
+#include <poll.h>
+#include <sys/time.h>
+#include <algorithm>
+#include "neusc_clientshm.h"
+#include "neusc_handoff.h"
+
+using namespace neusc;
+
+ClientShm::ClientShm() {
+	/* no TCP socket, the handle is the unix socket of connect_path */
+	ClientSync::close_handle();
+}
+
+ClientShm::~ClientShm() {
+	delete shm;
+}
+
+bool ClientShm::connect_path(const std::string& path, int timeout) {
+	close_handle();
+	int sock = Handoff::connect_path(path);
+	if (sock < 0)
+		return false;
+	struct timeval tv = { timeout, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	unsigned int type = 0;
+	std::vector<int> fds;
+	if (!Handoff::recv_fds(sock, type, fds) || type != Handoff::SHM || fds.size() != 3) {
+		std::for_each(fds.begin(), fds.end(), [](int fd) { ::close(fd); });
+		::close(sock);
+		return false;
+	}
+	shm = new ShmSegment();
+	if (!shm->attach(fds[0], fds[1], fds[2])) {
+		::perror("shm attach");
+		delete shm;
+		shm = nullptr;
+		::close(sock);
+		return false;
+	}
+	handle = sock;
+	return true;
+}
+
+void ClientShm::close_handle() {
+	ClientSync::close_handle();
+	delete shm;
+	shm = nullptr;
+}
+
+void ClientShm::disconnect() {
+	ClientSync::disconnect();
+	delete shm;
+	shm = nullptr;
+}
+
+bool ClientShm::wait_server() {
+	struct pollfd fds[2];
+	fds[0].fd = shm->client_efd;
+	fds[0].events = POLLIN;
+	fds[1].fd = handle;
+	fds[1].events = POLLRDHUP;
+	while (::poll(fds, 2, -1) < 0) {
+		if (errno != EINTR)
+			return false;
+	}
+	if (fds[1].revents != 0)
+		return false;
+	uint64_t value;
+	while (::read(shm->client_efd, &value, sizeof(value)) > 0)
+		;
+	return true;
+}
+
+bool ClientShm::write_socket_in_block(int fd, const char* buf, int len) {
+	if (fd < 0 || shm == nullptr)
+		return false;
+	ShmPipe& requests = shm->requests;
+	while (len > 0) {
+		size_t size = requests.write(buf, len);
+		if (size == 0) {
+			if (requests.is_broken())
+				return false;
+			if (requests.sleep_writer() && !wait_server())
+				return false;
+			continue;
+		}
+		if (requests.wake_reader())
+			ShmSegment::signal(shm->server_efd);
+		len -= size;
+		buf += size;
+	}
+	return true;
+}
+
+bool ClientShm::read_socket_in_block(int fd, char* buf, int len) {
+	if (fd < 0 || shm == nullptr)
+		return false;
+	ShmPipe& responses = shm->responses;
+	while (len > 0) {
+		const char* src;
+		size_t size = responses.peek(src);
+		if (size == 0) {
+			if (responses.is_broken())
+				return false;
+			/* the server is likely on it, sleeping costs more than a short wait */
+			for (int i = 0; i < SPIN_COUNT && responses.empty(); i++)
+				;
+			if (!responses.empty())
+				continue;
+			if (responses.sleep_reader() && !wait_server())
+				return false;
+			continue;
+		}
+		size = std::min(size, (size_t)len);
+		memcpy(buf, src, size);
+		responses.consume(size);
+		if (responses.wake_writer())
+			ShmSegment::signal(shm->server_efd);
+		len -= size;
+		buf += size;
+	}
+	return true;
+}
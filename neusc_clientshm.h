@@ -0,0 +1,39 @@
+#ifndef __NEUSC_CLIENTSHM_H_
+#define __NEUSC_CLIENTSHM_H_
+
+#include <string>
+#include "neusc_clientsync.h"
+#include "neusc_shm.h"
+
+namespace neusc {
+
+/* ClientShm is a ClientSync for a server on the same host, frames go 
+ * through the rings of a shared memory segment instead of TCP, so out and 
+ * in make no syscall while the server keeps up. the unix socket it connects
+ * by stays open, it tells either side the other has gone. it connects by 
+ * connect_path instead of set_remote and connect
+*/
+class ClientShm : public ClientSync {
+public:
+	ClientShm();
+	~ClientShm();
+	/* connect to the path of Server::set_shm_path, wait at most timeout 
+	 *	seconds for the segment
+	*/
+	bool connect_path(const std::string& path, int timeout = 5);
+	void close_handle() override;
+	void disconnect() override;
+
+protected:
+	bool write_socket_in_block(int fd, const char* buf, int len) override;
+	bool read_socket_in_block(int fd, char* buf, int len) override;
+	/* sleep until the server signals, false if it has gone */
+	bool wait_server();
+
+	/* times of polling the ring before sleeping */
+	static const int SPIN_COUNT = 1024;
+	ShmSegment* shm = nullptr;
+};
+} // namespace neusc
+
+#endif
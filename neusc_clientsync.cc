@@ -143,15 +143,23 @@ bool ClientSync::connect() {
 
 /* when return false, handle has been closed */
 bool ClientSync::out(const char* message, unsigned int length) {
+	return out(message, length, next_id++);
+}
+
+bool ClientSync::out(const char* message, unsigned int length, unsigned int id) {
 	if (handle < 0)
 		return false;
 
-	unsigned char len[4];
-	len[0] = length >> 24;
-	len[1] = (length & 0xFF0000U) >> 16;
-	len[2] = (length & 0xFF00U) >> 8;
-	len[3] = (length & 0xFFU);
-	if (!write_socket_in_block(handle, (char*)len, 4)) {
+	unsigned char header[8];
+	header[0] = length >> 24;
+	header[1] = (length & 0xFF0000U) >> 16;
+	header[2] = (length & 0xFF00U) >> 8;
+	header[3] = (length & 0xFFU);
+	header[4] = id >> 24;
+	header[5] = (id & 0xFF0000U) >> 16;
+	header[6] = (id & 0xFF00U) >> 8;
+	header[7] = (id & 0xFFU);
+	if (!write_socket_in_block(handle, (char*)header, request_id_on ? 8 : 4)) {
 		close_handle();
 		return false;
 	}
@@ -164,9 +172,14 @@ bool ClientSync::out(const char* message, unsigned int length) {
 
 /* when return false, handle has been closed */
 bool ClientSync::in(std::string& str) {
+	unsigned int id;
+	return in(str, id);
+}
+
+bool ClientSync::in(std::string& str, unsigned int& id) {
 	char *buf;
 	unsigned int length;
-	if (in(buf, length)) {
+	if (in(buf, length, id)) {
 		str = std::string(buf, buf + length);
 		delete[] buf;
 		return true;
@@ -175,16 +188,23 @@ bool ClientSync::in(std::string& str) {
 }
 
 bool ClientSync::in(char*& message, unsigned int& length) {
+	unsigned int id;
+	return in(message, length, id);
+}
+
+bool ClientSync::in(char*& message, unsigned int& length, unsigned int& id) {
 	if (handle < 0)
 		return false;
 
-	unsigned char len[4];
+	unsigned char header[8];
 	char* buf;
-	if (!read_socket_in_block(handle, (char*)len, 4)) {
+	if (!read_socket_in_block(handle, (char*)header, request_id_on ? 8 : 4)) {
 		close_handle();
 		return false;
 	}
-	length = (len[0] << 24) | (len[1] << 16) | (len[2] << 8) | len[3];
+	length = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+	id = request_id_on ? 
+		(header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7] : 0;
 	if(length <= 0)
 		return false;
 	buf = new char[length];
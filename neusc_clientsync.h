@@ -21,11 +21,11 @@ namespace neusc {
 class ClientSync {
 public:
 	ClientSync();
-	~ClientSync();
+	virtual ~ClientSync();
 	void init();
-	void close_handle();
+	virtual void close_handle();
 	bool set_remote(const char* name, int port);
-	void disconnect();
+	virtual void disconnect();
 
 	bool connect_timeout(int timeout);
 	bool connect();
@@ -34,23 +34,34 @@ public:
 		return handle > 0;
 	}
 
+	/* frames carry a request id echoed by server, server must set REQUEST_ID,
+	   then responses could come back in any order and be matched by id
+	*/
+	void set_request_id(bool on) { request_id_on = on; }
+
 	/* when return false, handle has been closed */
 	bool out(const char* message, unsigned int length);
 	bool out(const std::string& msg) {
 		return out(msg.data(), msg.size() + 1);
 	}
+	/* send with specific request id, only on request id mode */
+	bool out(const char* message, unsigned int length, unsigned int id);
 
 	/* when return false, handle has been closed */
 	bool in(std::string& str);
+	bool in(std::string& str, unsigned int& id);
 
 	/* return bool if success, message and length will be updated
 	   if success, you must delete[] message by yourself 
 	*/
 	bool in(char*& message, unsigned int &length);
+	/* id is the request id of the response, only on request id mode */
+	bool in(char*& message, unsigned int &length, unsigned int& id);
 
 protected:
-	bool write_socket_in_block(int fd, const char* buf, int len);
-	bool read_socket_in_block(int fd, char* buf, int len);
+	/* the transport, ClientShm goes through shared memory instead */
+	virtual bool write_socket_in_block(int fd, const char* buf, int len);
+	virtual bool read_socket_in_block(int fd, char* buf, int len);
 
 	static const int IP_LIST_COUNT = 4;
 	static const int IP_MAXSIZE = 32;
@@ -59,6 +70,8 @@ protected:
 	bool exception_on;
 	char server_ip_address[IP_LIST_COUNT][IP_MAXSIZE];
 	int server_ip_count = 0;
+	bool request_id_on = false;
+	unsigned int next_id = 0;
 };
 } // namespace neusc
 
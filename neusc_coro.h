@@ -0,0 +1,246 @@
+#ifndef __NEUSC_CORO_H_
+#define __NEUSC_CORO_H_
+
+/* coroutine handlers, needs -std=c++20. the library itself is C++14,
+ * this header only builds on Request::post and Request::watch
+*/
+#if __cplusplus < 202002L
+#error "neusc_coro.h needs C++20, compile with -std=c++20"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string>
+#include <utility>
+#include "neusc_server.h"
+#include "neusc_clientasync.h"
+
+namespace neusc {
+
+template<typename T = void> class Task;
+
+namespace detail {
+
+/* a Task starts when it's awaited, and resumes its awaiter when it ends */
+struct TaskPromiseBase {
+	std::coroutine_handle<> continuation;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		template<typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+			P& promise = h.promise();
+			if (promise.done) {
+				/* a detached task frees itself */
+				promise.finish();
+				h.destroy();
+				return std::noop_coroutine();
+			}
+			std::coroutine_handle<> c = promise.continuation;
+			return c ? c : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	/* like an exception out of onRequest in a work thread */
+	void unhandled_exception() { std::terminate(); }
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase {
+	typedef std::function<void(T)> Done;
+	std::optional<T> value;
+	Done done;
+	Task<T> get_return_object();
+	void return_value(T v) { value.emplace(std::move(v)); }
+	T result() { return std::move(*value); }
+	void finish() { done(result()); }
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+	typedef std::function<void()> Done;
+	Done done;
+	Task<void> get_return_object();
+	void return_void() {}
+	void result() {}
+	void finish() { done(); }
+};
+
+} // namespace detail
+
+/* Task is a lazy coroutine returning T, it runs when it's co_awaited,
+ * in the thread of its awaiter
+*/
+template<typename T>
+class Task {
+public:
+	typedef detail::TaskPromise<T> promise_type;
+
+	explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task() {
+		if (handle)
+			handle.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+		handle.promise().continuation = awaiter;
+		return handle;
+	}
+	T await_resume() { return handle.promise().result(); }
+
+	/* start the task without awaiting it, done is called with the result
+	 *	when it ends, then it frees itself
+	*/
+	void detach(typename promise_type::Done done) {
+		std::coroutine_handle<promise_type> h = std::exchange(handle, nullptr);
+		h.promise().done = std::move(done);
+		h.resume();
+	}
+protected:
+	std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+/* wrap a coroutine handler as ServerEvents::onRequest
+ *
+ *	events.onRequest = async_handler([](Request* request) -> Task<bool> {
+ *		co_await sleep_for(request, 10);
+ *		request->clone_response(request->get_size(), request->get_ptr());
+ *		request->end_response();
+ *		co_return true;
+ *	});
+ *
+ * the handler starts in the work thread, which is free again at its first
+ * suspension. after every co_await below it goes on in the net thread of
+ * the request's connection, so it must not block there, like INLINE_REQUEST.
+ * co_return false for no response, as onRequest returns false, otherwise
+ * the handler ends the response by end_response. handler is kept by the
+ * server, so the captures of a handler lambda live as long as the server.
+*/
+template<typename F>
+std::function<bool(Request*)> async_handler(F handler) {
+	return [handler](Request* request) -> bool {
+		handler(request).detach([request](bool respond) {
+			if (!respond)
+				request->discard_response();
+		});
+		return true;
+	};
+}
+
+/* resume in the net thread of request after ms */
+class SleepAwaiter {
+public:
+	SleepAwaiter(Request* r, unsigned int ms) : request(r), delay_ms(ms) {}
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> h) {
+		request->post([h]() { h.resume(); }, delay_ms);
+	}
+	void await_resume() const noexcept {}
+protected:
+	Request* request;
+	unsigned int delay_ms;
+};
+
+inline SleepAwaiter sleep_for(Request* request, unsigned int ms) {
+	return SleepAwaiter(request, ms);
+}
+
+/* move on to the net thread of request */
+inline SleepAwaiter to_reactor(Request* request) {
+	return SleepAwaiter(request, 0);
+}
+
+/* resume in the net thread of request when fd is ready for events,
+ * co_await returns the ready events, EPOLLERR if fd can't be watched or
+ * the wait is cancelled by request->unwatch(fd). fd must stay open while
+ * it's awaited
+*/
+class FdAwaiter {
+public:
+	FdAwaiter(Request* r, int f, unsigned int e) : request(r), fd(f), events(e), ready(0) {}
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> h) {
+		request->watch(fd, events, [this, h](unsigned int e) {
+			ready = e;
+			h.resume();
+		});
+	}
+	unsigned int await_resume() const noexcept { return ready; }
+protected:
+	Request* request;
+	int fd;
+	unsigned int events;
+	unsigned int ready;
+};
+
+inline FdAwaiter wait_readable(Request* request, int fd) {
+	return FdAwaiter(request, fd, EPOLLIN);
+}
+
+inline FdAwaiter wait_writable(Request* request, int fd) {
+	return FdAwaiter(request, fd, EPOLLOUT);
+}
+
+/* response of a ClientAsync call, ok is false if the call failed */
+struct CallResult {
+	bool ok;
+	std::string data;
+};
+
+/* submit msg on conn of client, resume in the net thread of request with
+ * the response, so a handler can call other services without blocking
+*/
+class CallAwaiter {
+public:
+	CallAwaiter(ClientAsync& c, int cn, Request* r, std::string m) :
+		client(c), conn(cn), request(r), msg(std::move(m)) {}
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> h) {
+		Request* r = request;
+		/* the callback runs in the loop thread of client, copy the response
+		 *	and hop to the reactor before resuming
+		*/
+		client.submit(conn, msg, [this, r, h](bool ok, const char* data, unsigned int length) {
+			result.ok = ok;
+			if (ok)
+				result.data.assign(data, length);
+			r->post([h]() { h.resume(); });
+		});
+	}
+	CallResult await_resume() { return std::move(result); }
+protected:
+	ClientAsync& client;
+	int conn;
+	Request* request;
+	std::string msg;
+	CallResult result;
+};
+
+inline CallAwaiter call(ClientAsync& client, int conn, Request* request, std::string msg) {
+	return CallAwaiter(client, conn, request, std::move(msg));
+}
+
+} // namespace neusc
+
+#endif
@@ -0,0 +1,118 @@
+#include "neusc_handoff.h"
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace neusc;
+
+static bool fill_address(const std::string& path, struct sockaddr_un& address) {
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	memcpy(address.sun_path, path.data(), path.size());
+	return true;
+}
+
+int Handoff::listen_path(const std::string& path, int backlog) {
+	struct sockaddr_un address;
+	if (!fill_address(path, address))
+		return -1;
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	unlink(path.c_str());
+	if (bind(sock, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+			listen(sock, backlog) < 0) {
+		int saved = errno;
+		::close(sock);
+		errno = saved;
+		return -1;
+	}
+	return sock;
+}
+
+int Handoff::connect_path(const std::string& path) {
+	struct sockaddr_un address;
+	if (!fill_address(path, address))
+		return -1;
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	if (connect(sock, (struct sockaddr*)&address, sizeof(address)) < 0) {
+		int saved = errno;
+		::close(sock);
+		errno = saved;
+		return -1;
+	}
+	return sock;
+}
+
+bool Handoff::send_fds(int sock, unsigned int type, const int* fds, int count) {
+	if (count < 0 || count > MAX_FDS) {
+		errno = EINVAL;
+		return false;
+	}
+	struct iovec iov;
+	iov.iov_base = &type;
+	iov.iov_len = sizeof(type);
+	char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (count > 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+	}
+	ssize_t ret;
+	do {
+		ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+	return ret == sizeof(type);
+}
+
+bool Handoff::recv_fds(int sock, unsigned int& type, std::vector<int>& fds) {
+	struct iovec iov;
+	iov.iov_base = &type;
+	iov.iov_len = sizeof(type);
+	char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t ret;
+	do {
+		ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (ret < 0 && errno == EINTR);
+	if (ret == 0)
+		errno = 0;
+	if (ret <= 0)
+		return false;
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; 
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const int* data = (const int*)CMSG_DATA(cmsg);
+		fds.insert(fds.end(), data, data + count);
+	}
+	if (ret != sizeof(type) || (msg.msg_flags & MSG_CTRUNC)) {
+		errno = EPROTO;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,44 @@
+#ifndef __NEUSC_HANDOFF_H_
+#define __NEUSC_HANDOFF_H_
+
+#include <string>
+#include <vector>
+
+namespace neusc {
+
+/* Handoff passes sockets from a serving process to the one replacing it,
+ * over a SOCK_SEQPACKET unix socket with SCM_RIGHTS, so message bounds
+ * keep every batch of fds with its type. the old process listens on path,
+ * the new one connects to it. the server also passes the segment of a
+ * shared memory connection to its client by it. the helpers set errno and
+ * return false on failure, like the system calls they wrap
+*/
+class Handoff {
+public:
+	enum : unsigned int {
+		LISTEN = 1,
+		CONNECTIONS = 2,
+		/* memfd and eventfds of a segment, see Server::set_shm_path */
+		SHM = 3,
+	};
+	/* fds of one message, SCM_MAX_FD is 253 */
+	constexpr static const int MAX_FDS = 64;
+
+	/* listen on path, replacing a stale socket file, return -1 if fails */
+	static int listen_path(const std::string& path, int backlog = 1);
+	/* connect to path, return -1 if no process serves it */
+	static int connect_path(const std::string& path);
+	/* send count fds, at most MAX_FDS, the receiver gets duplicates.
+	 *	errno is EAGAIN if a non-blocking sock is full
+	*/
+	static bool send_fds(int sock, unsigned int type, const int* fds, int count);
+	/* receive one message, fds are appended, return false on EOF or
+	 *	error, errno is 0 on EOF, EAGAIN if a non-blocking sock has nothing.
+	 *	fds received with a bad message are appended too
+	*/
+	static bool recv_fds(int sock, unsigned int& type, std::vector<int>& fds);
+};
+
+} // namespace neusc
+
+#endif
@@ -0,0 +1,98 @@
+#include "neusc_histogram.h"
+#include <cstring>
+#include <cstdio>
+
+using namespace neusc;
+
+Histogram::Histogram() {
+	reset();
+}
+
+void Histogram::reset() {
+	memset(counts, 0, sizeof(counts));
+	total = 0;
+	sum = 0;
+	min_value = UINT64_MAX;
+	max_value = 0;
+}
+
+void Histogram::merge(const Histogram& other) {
+	for (int i = 0; i < BUCKET_COUNT; i++)
+		counts[i] += other.counts[i];
+	total += other.total;
+	sum += other.sum;
+	if (other.min_value < min_value)
+		min_value = other.min_value;
+	if (other.max_value > max_value)
+		max_value = other.max_value;
+}
+
+uint64_t Histogram::highest_of(int index) {
+	if (index < SUB_COUNT)
+		return index;
+	int shift = index / SUB_COUNT - 1;
+	uint64_t sub = index % SUB_COUNT + SUB_COUNT;
+	return ((sub + 1) << shift) - 1;
+}
+
+/*
+ * walk the buckets until the count reaches percent of total,
+ * the max is exact, so it bounds the bucket value
+*/
+uint64_t Histogram::percentile(double percent) const {
+	if (total == 0)
+		return 0;
+	if (percent > 100)
+		percent = 100;
+	uint64_t target = (uint64_t)(percent / 100 * total + 0.5);
+	if (target == 0)
+		target = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < BUCKET_COUNT; i++) {
+		seen += counts[i];
+		if (seen >= target) {
+			uint64_t value = highest_of(i);
+			return value < max_value ? value : max_value;
+		}
+	}
+	return max_value;
+}
+
+std::string Histogram::summary(double scale) const {
+	char line[256];
+	snprintf(line, sizeof(line),
+			"count %lu mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f",
+			(unsigned long)total, mean() / scale,
+			percentile(50) / scale, percentile(90) / scale,
+			percentile(99) / scale, percentile(99.9) / scale,
+			max() / scale);
+	return line;
+}
+
+AtomicHistogram::AtomicHistogram() : sum(0), min_value(UINT64_MAX), max_value(0) {
+	for (int i = 0; i < Histogram::BUCKET_COUNT; i++)
+		counts[i].store(0, std::memory_order_relaxed);
+}
+
+/*
+ * the writer may go on while copying, total is summed from the counts
+ * copied, so percentiles stay consistent
+*/
+void AtomicHistogram::merge_into(Histogram& histogram) const {
+	uint64_t total = 0;
+	for (int i = 0; i < Histogram::BUCKET_COUNT; i++) {
+		uint64_t n = counts[i].load(std::memory_order_relaxed);
+		histogram.counts[i] += n;
+		total += n;
+	}
+	if (total == 0)
+		return;
+	histogram.total += total;
+	histogram.sum += sum.load(std::memory_order_relaxed);
+	uint64_t v = min_value.load(std::memory_order_relaxed);
+	if (v < histogram.min_value)
+		histogram.min_value = v;
+	v = max_value.load(std::memory_order_relaxed);
+	if (v > histogram.max_value)
+		histogram.max_value = v;
+}
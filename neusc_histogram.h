@@ -0,0 +1,99 @@
+#ifndef __NEUSC_HISTOGRAM_H_
+#define __NEUSC_HISTOGRAM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <atomic>
+
+namespace neusc {
+
+/* Histogram counts values in log-linear buckets like HdrHistogram,
+ * every power of 2 range is split into SUB_COUNT linear buckets, so the
+ * error of a reported percentile is within 1/SUB_COUNT of the value,
+ * from 0 to UINT64_MAX. record is O(1) and takes no lock, a histogram
+ * is owned by one thread, and merged into another for reporting.
+*/
+class Histogram {
+	friend class AtomicHistogram;
+public:
+	constexpr static const int SUB_BITS = 5;
+	constexpr static const int SUB_COUNT = 1 << SUB_BITS;
+	constexpr static const int BUCKET_COUNT = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+	Histogram();
+
+	void record(uint64_t value) {
+		counts[index_of(value)]++;
+		total++;
+		sum += value;
+		if (value < min_value)
+			min_value = value;
+		if (value > max_value)
+			max_value = value;
+	}
+	void merge(const Histogram& other);
+	void reset();
+
+	uint64_t count() const { return total; }
+	uint64_t min() const { return total ? min_value : 0; }
+	uint64_t max() const { return max_value; }
+	double mean() const { return total ? (double)sum / total : 0; }
+	/* the highest value equivalent to the value at percent (0 - 100) */
+	uint64_t percentile(double percent) const;
+
+	/* one line of count, mean, p50, p90, p99, p99.9 and max,
+	 * values are divided by scale, e.g. 1000 to print ns as us
+	*/
+	std::string summary(double scale = 1) const;
+
+	static int index_of(uint64_t value) {
+		if (value < (uint64_t)SUB_COUNT)
+			return (int)value;
+		int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+		return (shift + 1) * SUB_COUNT + (int)((value >> shift) - SUB_COUNT);
+	}
+	/* the highest value counted in bucket index */
+	static uint64_t highest_of(int index);
+
+protected:
+	uint64_t counts[BUCKET_COUNT];
+	uint64_t total;
+	/* wraps only after 2^64 ns of latency in total, good enough for mean */
+	uint64_t sum;
+	uint64_t min_value;
+	uint64_t max_value;
+};
+
+/* AtomicHistogram is written by one thread and read by any thread,
+ * record takes relaxed loads and stores only, no locked instruction.
+ * readers copy it into a Histogram to get percentiles
+*/
+class AtomicHistogram {
+public:
+	AtomicHistogram();
+
+	void record(uint64_t value) {
+		bump(counts[Histogram::index_of(value)], 1);
+		bump(sum, value);
+		if (value < min_value.load(std::memory_order_relaxed))
+			min_value.store(value, std::memory_order_relaxed);
+		if (value > max_value.load(std::memory_order_relaxed))
+			max_value.store(value, std::memory_order_relaxed);
+	}
+	/* add the counts seen now into histogram */
+	void merge_into(Histogram& histogram) const;
+
+protected:
+	static void bump(std::atomic<uint64_t>& a, uint64_t n) {
+		a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	std::atomic<uint64_t> counts[Histogram::BUCKET_COUNT];
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> min_value;
+	std::atomic<uint64_t> max_value;
+};
+
+} // namespace neusc
+
+#endif
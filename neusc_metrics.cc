@@ -0,0 +1,83 @@
+#include "neusc_metrics.h"
+#include <cstdio>
+
+using namespace neusc;
+
+MetricsSnapshot::MetricsSnapshot() : connections(0), accepted(0), closed(0),
+		frames_in(0), frames_out(0), bytes_in(0), bytes_out(0), discarded(0),
+		pauses(0), timeouts(0), expired(0), paused(0), pending(0), wait_send(0) {
+}
+
+void MetricsSnapshot::add(const ReactorMetrics& metrics) {
+	accepted += metrics.accepted.get();
+	closed += metrics.closed.get();
+	connections = accepted > closed ? accepted - closed : 0;
+	frames_in += metrics.frames_in.get();
+	frames_out += metrics.frames_out.get();
+	bytes_in += metrics.bytes_in.get();
+	bytes_out += metrics.bytes_out.get();
+	discarded += metrics.discarded.get();
+	pauses += metrics.pauses.get();
+	timeouts += metrics.timeouts.get();
+	expired += metrics.expired.get();
+	for (int i = 0; i < STAGE_COUNT; i++)
+		metrics.stages[i].merge_into(stages[i]);
+}
+
+const char* MetricsSnapshot::stage_name(int stage) {
+	static const char* names[STAGE_COUNT] = {
+		"read", "queue", "handle", "write", "total"
+	};
+	return stage >= 0 && stage < STAGE_COUNT ? names[stage] : "unknown";
+}
+
+std::string MetricsSnapshot::to_text(const std::string& prefix) const {
+	std::string text;
+	char line[256];
+	const char* p = prefix.c_str();
+	const struct {
+		const char* name;
+		uint64_t value;
+	} values[] = {
+		{ "connections", connections },
+		{ "connections_accepted_total", accepted },
+		{ "connections_closed_total", closed },
+		{ "frames_in_total", frames_in },
+		{ "frames_out_total", frames_out },
+		{ "bytes_in_total", bytes_in },
+		{ "bytes_out_total", bytes_out },
+		{ "requests_discarded_total", discarded },
+		{ "connection_pauses_total", pauses },
+		{ "connection_timeouts_total", timeouts },
+		{ "requests_expired_total", expired },
+		{ "connections_paused", paused },
+		{ "requests_pending", pending },
+		{ "responses_wait_send", wait_send },
+	};
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		snprintf(line, sizeof(line), "%s_%s %lu\n", p, values[i].name,
+				(unsigned long)values[i].value);
+		text += line;
+	}
+
+	const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+	for (int s = 0; s < STAGE_COUNT; s++) {
+		const Histogram& h = stages[s];
+		if (h.count() == 0)
+			continue;
+		for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+			snprintf(line, sizeof(line),
+					"%s_stage_latency_us{stage=\"%s\",quantile=\"%g\"} %.1f\n",
+					p, stage_name(s), quantiles[q],
+					h.percentile(quantiles[q] * 100) / 1000.0);
+			text += line;
+		}
+		snprintf(line, sizeof(line), "%s_stage_latency_us_sum{stage=\"%s\"} %.1f\n",
+				p, stage_name(s), h.mean() * h.count() / 1000.0);
+		text += line;
+		snprintf(line, sizeof(line), "%s_stage_latency_us_count{stage=\"%s\"} %lu\n",
+				p, stage_name(s), (unsigned long)h.count());
+		text += line;
+	}
+	return text;
+}
@@ -0,0 +1,103 @@
+#ifndef __NEUSC_METRICS_H_
+#define __NEUSC_METRICS_H_
+
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <time.h>
+#include "neusc_histogram.h"
+
+namespace neusc {
+
+inline uint64_t clock_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Counter is written by one thread and read by any thread,
+ * so adding is a relaxed load and store, no locked instruction
+*/
+class Counter {
+public:
+	Counter() : value(0) {}
+	void add(uint64_t n = 1) {
+		value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	uint64_t get() const { return value.load(std::memory_order_relaxed); }
+protected:
+	std::atomic<uint64_t> value;
+};
+
+/* stages of one request, timed when Server::STAGE_METRICS is set */
+enum Stage {
+	/* the read bringing the first byte of frame -> the read completing it */
+	STAGE_READ,
+	/* frame completed -> picked by work thread */
+	STAGE_QUEUE,
+	/* picked -> end_response */
+	STAGE_HANDLE,
+	/* end_response -> response written completely */
+	STAGE_WRITE,
+	/* frame completed -> response written completely */
+	STAGE_TOTAL,
+	STAGE_COUNT
+};
+
+/* metrics of one reactor, only written by the reactor thread */
+struct ReactorMetrics {
+	Counter accepted;
+	Counter closed;
+	Counter frames_in;
+	Counter frames_out;
+	Counter bytes_in;
+	Counter bytes_out;
+	/* requests dropped without response as onRequest returned false */
+	Counter discarded;
+	/* times of a connection paused on in flight limits */
+	Counter pauses;
+	/* connections closed by idle, read or write timeouts */
+	Counter timeouts;
+	/* requests picked after their deadline */
+	Counter expired;
+	/* nanoseconds */
+	AtomicHistogram stages[STAGE_COUNT];
+};
+
+/* MetricsSnapshot sums the metrics of all reactors at one moment,
+ * counters are totals since the server started
+*/
+struct MetricsSnapshot {
+	uint64_t connections;
+	uint64_t accepted;
+	uint64_t closed;
+	uint64_t frames_in;
+	uint64_t frames_out;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t discarded;
+	uint64_t pauses;
+	uint64_t timeouts;
+	uint64_t expired;
+	/* connections not read now because of in flight limits */
+	uint64_t paused;
+	/* requests waiting for work threads */
+	uint64_t pending;
+	/* responses matured but not written completely */
+	uint64_t wait_send;
+	/* nanoseconds, empty unless Server::STAGE_METRICS is set */
+	Histogram stages[STAGE_COUNT];
+
+	MetricsSnapshot();
+	void add(const ReactorMetrics& metrics);
+	static const char* stage_name(int stage);
+
+	/* one metric per line as "name value" in the Prometheus text format,
+	 * stage latency is a summary in microseconds
+	*/
+	std::string to_text(const std::string& prefix = "neusc") const;
+};
+
+} // namespace neusc
+
+#endif
@@ -0,0 +1,145 @@
+#include "neusc_pool.h"
+#include <cassert>
+
+using namespace neusc;
+
+Pool::Depot Pool::depots[Pool::CLASS_COUNT];
+std::atomic<size_t> Pool::system_allocs(0);
+
+namespace neusc {
+
+/* free lists of one thread, flushed to depot when the thread exits */
+struct PoolCache {
+	Pool::Block* heads[Pool::CLASS_COUNT];
+	int counts[Pool::CLASS_COUNT];
+
+	PoolCache();
+	~PoolCache();
+	void give(int c, int count);
+};
+
+} // namespace neusc
+
+enum { CACHE_FRESH = 0, CACHE_ALIVE, CACHE_DEAD };
+static thread_local int cache_state = CACHE_FRESH;
+
+/* return nullptr after the cache of this thread has been destroyed */
+static PoolCache* local_cache() {
+	if (cache_state == CACHE_DEAD)
+		return nullptr;
+	static thread_local PoolCache cache;
+	return &cache;
+}
+
+PoolCache::PoolCache() {
+	for (int c = 0; c < Pool::CLASS_COUNT; c++) {
+		heads[c] = nullptr;
+		counts[c] = 0;
+	}
+	cache_state = CACHE_ALIVE;
+}
+
+PoolCache::~PoolCache() {
+	for (int c = 0; c < Pool::CLASS_COUNT; c++) {
+		if (counts[c] > 0)
+			give(c, counts[c]);
+	}
+	cache_state = CACHE_DEAD;
+}
+
+/* move count blocks from head of class c to depot as one batch */
+void PoolCache::give(int c, int count) {
+	Pool::Block* batch = heads[c];
+	Pool::Block* tail = batch;
+	for (int i = 1; i < count; i++)
+		tail = tail->next;
+	heads[c] = tail->next;
+	counts[c] -= count;
+	tail->next = nullptr;
+	Pool::give_batch(c, batch);
+}
+
+int Pool::class_of(size_t size) {
+	if (size > ((size_t)1 << MAX_SHIFT))
+		return -1;
+	if (size <= ((size_t)1 << MIN_SHIFT))
+		return 0;
+	int shift = 64 - __builtin_clzl(size - 1);
+	return shift - MIN_SHIFT;
+}
+
+/* small class keeps CACHE_BLOCKS blocks, large class keeps CACHE_BYTES at most */
+int Pool::cache_limit(int c) {
+	int limit = (int)(CACHE_BYTES >> (c + MIN_SHIFT));
+	if (limit > CACHE_BLOCKS)
+		limit = CACHE_BLOCKS;
+	if (limit < 2)
+		limit = 2;
+	return limit;
+}
+
+size_t Pool::capacity(size_t size) {
+	int c = class_of(size);
+	if (c < 0)
+		return size;
+	return (size_t)1 << (c + MIN_SHIFT);
+}
+
+Pool::Block* Pool::take_batch(int c) {
+	Depot& depot = depots[c];
+	std::lock_guard<std::mutex> lock(depot.mutex);
+	Block* batch = depot.batches;
+	if (batch != nullptr)
+		depot.batches = batch->next_batch;
+	return batch;
+}
+
+void Pool::give_batch(int c, Block* batch) {
+	Depot& depot = depots[c];
+	std::lock_guard<std::mutex> lock(depot.mutex);
+	batch->next_batch = depot.batches;
+	depot.batches = batch;
+}
+
+void* Pool::alloc(size_t size, size_t& capacity) {
+	int c = class_of(size);
+	PoolCache* cache = local_cache();
+	if (c < 0 || cache == nullptr) {
+		capacity = Pool::capacity(size);
+		system_allocs++;
+		return ::malloc(capacity);
+	}
+	capacity = (size_t)1 << (c + MIN_SHIFT);
+	Block* block = cache->heads[c];
+	if (block == nullptr) {
+		block = take_batch(c);
+		if (block == nullptr) {
+			system_allocs++;
+			return ::malloc(capacity);
+		}
+		int count = 0;
+		for (Block* b = block; b != nullptr; b = b->next)
+			count++;
+		cache->counts[c] = count;
+	}
+	cache->heads[c] = block->next;
+	cache->counts[c]--;
+	return block;
+}
+
+void Pool::free(void* p, size_t size) {
+	if (p == nullptr)
+		return;
+	int c = class_of(size);
+	PoolCache* cache = local_cache();
+	if (c < 0 || cache == nullptr) {
+		::free(p);
+		return;
+	}
+	Block* block = (Block*)p;
+	block->next = cache->heads[c];
+	cache->heads[c] = block;
+	int limit = cache_limit(c);
+	if (++cache->counts[c] > limit)
+		cache->give(c, limit / 2);
+}
@@ -0,0 +1,66 @@
+#ifndef __NEUSC_POOL_H_
+#define __NEUSC_POOL_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <atomic>
+#include <mutex>
+
+namespace neusc {
+
+/* Pool recycles memory blocks in power of 2 size classes, from 64 bytes to 1M.
+ * every thread keeps its own free lists, so alloc and free take no lock
+ * in steady state. when a free list is too long (or empty), the thread moves
+ * a batch of blocks to (or takes a batch from) the shared depot of the class.
+ * blocks bigger than the largest class are allocated from system directly.
+*/
+class Pool {
+public:
+	constexpr static const int MIN_SHIFT = 6;
+	constexpr static const int MAX_SHIFT = 20;
+	constexpr static const int CLASS_COUNT = MAX_SHIFT - MIN_SHIFT + 1;
+	/* max bytes a thread keeps in one class */
+	constexpr static const size_t CACHE_BYTES = 1024 * 1024;
+	/* max blocks a thread keeps in one class */
+	constexpr static const int CACHE_BLOCKS = 64;
+
+	/* return a block of at least size bytes, capacity is set to its real size */
+	static void* alloc(size_t size, size_t& capacity);
+	static void* alloc(size_t size) {
+		size_t capacity;
+		return alloc(size, capacity);
+	}
+
+	/* size could be the size asked for or the capacity returned by alloc */
+	static void free(void* block, size_t size);
+
+	/* the real size of block which alloc returns for size */
+	static size_t capacity(size_t size);
+
+	/* count of blocks allocated from system, stays flat in steady state */
+	static size_t system_alloc_count() { return system_allocs.load(); }
+
+protected:
+	friend struct PoolCache;
+	struct Block {
+		Block* next;
+		/* only valid at the first block of a batch in depot */
+		Block* next_batch;
+	};
+	struct Depot {
+		std::mutex mutex;
+		Block* batches;
+	};
+
+	static int class_of(size_t size);
+	static int cache_limit(int c);
+	static Block* take_batch(int c);
+	static void give_batch(int c, Block* batch);
+
+	static Depot depots[CLASS_COUNT];
+	static std::atomic<size_t> system_allocs;
+};
+
+} // namespace neusc
+
+#endif
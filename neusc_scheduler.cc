@@ -0,0 +1,50 @@
+#include "neusc_scheduler.h"
+#include "neusc_server.h"
+#include <algorithm>
+
+using namespace neusc;
+
+PriorityScheduler::PriorityScheduler(int classes) : queues(classes > 0 ? classes : 1), count(0) {
+}
+
+void PriorityScheduler::push(Request* request) {
+	int priority = request->get_priority();
+	if (priority < 0)
+		priority = 0;
+	else if (priority >= (int)queues.size())
+		priority = (int)queues.size() - 1;
+	queues[priority].push_back(request);
+	count++;
+}
+
+Request* PriorityScheduler::pop() {
+	if (count == 0)
+		return nullptr;
+	for (size_t i = 0; i < queues.size(); i++) {
+		if (!queues[i].empty()) {
+			Request* request = queues[i].front();
+			queues[i].pop_front();
+			count--;
+			return request;
+		}
+	}
+	return nullptr;
+}
+
+DeadlineScheduler::DeadlineScheduler() : order(0) {
+}
+
+void DeadlineScheduler::push(Request* request) {
+	uint64_t deadline = request->get_deadline();
+	heap.push_back(Entry{ deadline ? deadline : UINT64_MAX, order++, request });
+	std::push_heap(heap.begin(), heap.end());
+}
+
+Request* DeadlineScheduler::pop() {
+	if (heap.empty())
+		return nullptr;
+	std::pop_heap(heap.begin(), heap.end());
+	Request* request = heap.back().request;
+	heap.pop_back();
+	return request;
+}
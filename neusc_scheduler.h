@@ -0,0 +1,67 @@
+#ifndef __NEUSC_SCHEDULER_H_
+#define __NEUSC_SCHEDULER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <deque>
+
+namespace neusc {
+
+class Request;
+
+/* Scheduler orders the pending requests for work threads, set by
+ * Server::set_scheduler. push and pop are called with the pending lock
+ * held, so a scheduler needs no lock of its own. requests are classified
+ * by ServerEvents::onClassify before they are pushed.
+*/
+class Scheduler {
+public:
+	virtual ~Scheduler() {}
+	virtual void push(Request* request) = 0;
+	/* return nullptr if empty */
+	virtual Request* pop() = 0;
+	virtual size_t size() const = 0;
+};
+
+/* FIFO queue of every priority class, the lowest class which is not empty
+ * runs first, priority is clamped to [0, classes - 1]. O(classes) at most
+*/
+class PriorityScheduler : public Scheduler {
+public:
+	PriorityScheduler(int classes);
+	void push(Request* request) override;
+	Request* pop() override;
+	size_t size() const override { return count; }
+protected:
+	std::vector<std::deque<Request*>> queues;
+	size_t count;
+};
+
+/* earliest deadline first by a binary heap, O(log n). requests without
+ * deadline run after all with deadline, the same deadlines run in order
+*/
+class DeadlineScheduler : public Scheduler {
+public:
+	DeadlineScheduler();
+	void push(Request* request) override;
+	Request* pop() override;
+	size_t size() const override { return heap.size(); }
+protected:
+	struct Entry {
+		uint64_t deadline;
+		uint64_t order;
+		Request* request;
+		/* std heap is a max heap, so the earliest is the greatest */
+		bool operator<(const Entry& other) const {
+			return deadline != other.deadline ? deadline > other.deadline :
+				order > other.order;
+		}
+	};
+	std::vector<Entry> heap;
+	uint64_t order;
+};
+
+} // namespace neusc
+
+#endif
@@ -1,560 +1,2917 @@
 #include "neusc_server.h"
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
 
 using namespace neusc;
 using namespace std;
 
-Request::Request(Server* s, int h) : 
-		server(s), response(nullptr), data(nullptr), handle(h), 
-		matured(false), discard(false),
-		body_has_read(0), length_has_read(0) {
-	reserved_size = RESERVED_SIZE;
-	data = new char[reserved_size];
-	assert(data);
-	memset(length_buf, 0, 4);
+/* set while the reactor calls onRequest inline, end_response in it needs no wakeup */
+static thread_local Reactor* inline_reactor = nullptr;
+
+Request::Request(Connection* c) : 
+		server(c->reactor->server), reactor(c->reactor), connection(c),
+		response(nullptr), data(nullptr), handle(c->handle), 
+		sequence(0), next_completed(nullptr), matured(false), discard(false),
+		streaming(false), context(nullptr), priority(0), deadline(0), run_inline(false), expired(false), read_begin_ns(0), read_end_ns(0), picked_ns(0), ended_ns(0),
+		frame_size(0), reserved_size(0), body_has_read(0), header_has_read(0) {
+	header_size = (server->config & Server::REQUEST_ID) ? 8 : 4;
+	memset(header_buf, 0, sizeof(header_buf));
+	connection->acquire();
 }
 
 Request::~Request() {
 	if (data != nullptr)
-		delete[] data;
+		Pool::free(data, reserved_size);
 	if (response != nullptr)
 		delete response;
+	connection->release();
 }
 
-bool Request::reserve_size(int new_size) {
+/*
+ * body buffer is taken from Pool when the length is known,
+ * so it's normally reserved once in the size class of body length
+*/
+bool Request::reserve_size(size_t new_size) {
 	if (new_size <= reserved_size)
 		return true;
-	int prepare_size = reserved_size;
-	while (new_size > prepare_size)
-		prepare_size *= 2;
-	char* alloc_data = new char[prepare_size];
+	size_t capacity;
+	if (new_size < RESERVED_SIZE)
+		new_size = RESERVED_SIZE;
+	char* alloc_data = (char*)Pool::alloc(new_size, capacity);
 	if (alloc_data == nullptr)
 		return false;
-	memcpy(alloc_data, data, body_has_read);
-	delete[] data;
+	if (data != nullptr) {
+		memcpy(alloc_data, data, body_has_read);
+		Pool::free(data, reserved_size);
+	}
 	data = alloc_data;
-	reserved_size = prepare_size;
+	reserved_size = capacity;
 	return true;
 }
 
-void Request::append_data(const char* src, int size, int handle, Server* server) {
-	int copy_len;
-	if (size == 0)
-		return;
+/*
+ * copy from src until the request is full, return the bytes taken,
+ * the body buffer is reserved as soon as the length header is complete,
+ * unless the body is streamed, then only the header is taken
+*/
+int Request::append_data(const char* src, int size) {
+	int copy_len, taken = 0;
+	unsigned int remain;
 
-	if (length_has_read < 4) {
-		copy_len = min(size, 4 - length_has_read);
-		memcpy(length_buf + length_has_read, src, copy_len);
-		length_has_read += copy_len;
+	if (header_has_read < header_size) {
+		copy_len = min(size, header_size - header_has_read);
+		memcpy(header_buf + header_has_read, src, copy_len);
+		header_has_read += copy_len;
 		src += copy_len;
 		size -= copy_len;
+		taken += copy_len;
+		if (header_has_read < header_size)
+			return taken;
+		if (server->server_events.onStream && get_length() >= server->stream_threshold)
+			streaming = true;
+		else
+			reserve_size(get_length());
 	}
-	if (size == 0)
-		return;
-	int body_length = get_length();
-	int remain_body_size = body_length - body_has_read;
-	copy_len = min(size, remain_body_size);
-	reserve_size(body_length);
-	memcpy(data + body_has_read, src, copy_len);
-	body_has_read += copy_len;
-	src += copy_len;
-	size -= copy_len;
-
-	if (body_has_read == body_length) {
-		/* read complete */
-		server->move_premature_request(handle);
-		server->notify_working();
-	}
-	if (size > 0) {
-		Request* request = server->get_handle_request(handle);
-		request->append_data(src, size, handle, server);
+	if (streaming)
+		return taken;
+	remain = get_length() - body_has_read;
+	copy_len = remain < (unsigned int)size ? (int)remain : size;
+	if (copy_len > 0) {
+		memcpy(data + body_has_read, src, copy_len);
+		body_has_read += copy_len;
+		taken += copy_len;
 	}
+	return taken;
 }
 
-void Request::clone_response(int size, const char* buf) {
+void Request::clone_response(size_t size, const char* buf) {
 	Response *r = response;
-	assert (size > 0);
-	if (r->data)
-		delete [](r->data);
-	r->data = new char[size];
+	assert (size > 0 && size <= UINT32_MAX);
+	r->release_data();
+	r->data = (char*)Pool::alloc(size, r->data_capacity);
 	assert(r->data);
 	memcpy(r->data, buf, size);
 	r->set_length(size);
 }
 
+void Request::refer_response(size_t size, const char* buf) {
+	Response *r = response;
+	assert (size > 0 && size <= UINT32_MAX);
+	r->release_data();
+	r->data = const_cast<char*>(buf);
+	r->data_capacity = 0;
+	r->set_length(size);
+}
+
+void Request::stream_response(size_t length, Response::Producer producer) {
+	Response *r = response;
+	assert (length > 0 && length <= UINT32_MAX && producer);
+	r->release_data();
+	r->producer = std::move(producer);
+	r->set_length(length);
+}
+
+/*
+ * io_uring has no sendfile, the range is mapped here in work thread, 
+ * the mapping starts at the page of offset
+*/
+bool Request::file_response(int fd, off_t offset, size_t length, bool own_fd) {
+	Response *r = response;
+	assert (fd >= 0 && length > 0 && length <= UINT32_MAX);
+	r->release_data();
+	r->file_fd = fd;
+	r->file_owned = own_fd;
+	r->file_offset = offset;
+	r->set_length(length);
+	/* a shared memory connection has no socket to sendfile to */
+	if (reactor->use_sendfile && connection->shm == nullptr)
+		return true;
+	off_t page = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	size_t map_size = length + (offset - page);
+	void* map = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, page);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		r->file_fd = -1;
+		r->file_owned = false;
+		if (own_fd)
+			::close(fd);
+		return false;
+	}
+	madvise(map, map_size, MADV_SEQUENTIAL);
+	r->map = (char*)map;
+	r->map_size = map_size;
+	r->data = r->map + (offset - page);
+	return true;
+}
+
+/* 
+ * hand the request to its connection, only the first call takes effect.
+ * the request must not be touched after, it belongs to the reactor or 
+ * has been deleted if the connection was closed
+*/
+void Request::complete() {
+	if (matured.exchange(true))
+		return;
+	if (server->config & Server::STAGE_METRICS)
+		ended_ns = clock_ns();
+	Reactor *r = reactor;
+	Connection *c = connection;
+	if (inline_reactor == r) {
+		/* handled inline, the reactor writes it after the read */
+		c->write_pending = true;
+		c->push_completed(this);
+		return;
+	}
+	/* the reference keeps connection alive until the reactor takes it */
+	c->acquire();
+	if (c->push_completed(this))
+		r->notify_completed(c);
+	else
+		c->release();
+}
+
 /* 
- * end_response make request matured 
- * don't need to lock mature_list, because it won't be touch if request->matured is false
+ * end_response make request matured, don't need any lock,
+ * the reactor is only waked up when the completed stack of connection was empty
 */
 void Request::end_response() {
-	matured = true;
-	if (!discard)
-		server->epoll_modify_socket(handle, EPOLLIN | EPOLLOUT | EPOLLET);
+	complete();
+}
+
+void Request::discard_response() {
+	discard = true;
+	complete();
+}
+
+void Request::post(std::function<void()> fn, unsigned int delay_ms) {
+	reactor->post(std::move(fn), delay_ms);
+}
+
+void Request::watch(int fd, unsigned int events, std::function<void(unsigned int)> fn) {
+	reactor->watch(fd, events, std::move(fn));
+}
+
+void Request::unwatch(int fd) {
+	reactor->unwatch(fd);
 }
 
 void Request::release_request_data() {
 	if (data) {
-		delete[] data;
+		Pool::free(data, reserved_size);
 		data = nullptr;
-		memset(length_buf, 0, 4);
+		memset(header_buf, 0, 4);
 		reserved_size = 0;
 		body_has_read = 0;
-		length_has_read = 0;
+		header_has_read = 0;
 	}
 }
 
-Response::Response(Request *r) : request(r), data(nullptr), 
-			body_has_written(0), length_has_written(0) {
-	memset(length_buf, 0, 4);
+Response::Response(Request *r) : request(r), data(nullptr), data_capacity(0),
+			producer(nullptr), chunk(nullptr), chunk_capacity(0), chunk_size(0),
+			chunk_written(0), produced(0), file_fd(-1), file_owned(false), file_offset(0),
+			map(nullptr), map_size(0), body_has_written(0), header_has_written(0) {
+	/* length is set later, request id is echoed as it is */
+	header_size = r->header_size;
+	memcpy(header_buf, r->header_buf, sizeof(header_buf));
+	memset(header_buf, 0, 4);
 }
 
 Response::~Response() {
-	if (data)
-		delete[] data;
+	release_data();
 }
 
-void Response::write_data(int handle, Server* server) {
-	int write_num, has_remain;
-	if (length_has_written < 4) {
-		has_remain = 4 - length_has_written;
-		write_num = write(handle, length_buf + length_has_written, has_remain);
-		if (write_num < 0) {
-			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
-				return;
-			/* network fail, maybe peer abort, like as EPIPE */
-			perror("write<0");
-			server->close_connection(handle);
-			server->epoll_delete_socket(handle);
-			server->clear_handle(handle);
-			if (server->server_events.onPeerReset)
-				server->server_events.onPeerReset(handle);
-			return;
-		}
-		length_has_written += write_num;
-		if (has_remain != write_num)
-			return;
+void Response::release_data() {
+	if (map) {
+		munmap(map, map_size);
+		map = nullptr;
+		map_size = 0;
+		data = nullptr;
 	}
-	has_remain = get_length() - body_has_written;
-	write_num = write(handle, data + body_has_written, has_remain);
-	if (write_num < 0) {
-		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
-			return;
-		perror("write<0");
-		server->close_connection(handle);
-		server->epoll_delete_socket(handle);
-		server->clear_handle(handle);
-		if (server->server_events.onPeerReset)
-			server->server_events.onPeerReset(handle);
-		return;
+	if (file_fd >= 0) {
+		if (file_owned)
+			::close(file_fd);
+		file_fd = -1;
+		file_owned = false;
 	}
-	body_has_written += write_num;
-	if (write_num == has_remain) {
-		/* send complete */
-		server->sending_map.erase(handle);
-		delete this->request;
-		Request *request = server->move_sending_request(handle);
-		if (request != nullptr) {
-			request->response->write_data(handle, server);
-		}
+	if (data) {
+		if (data_capacity > 0)
+			Pool::free(data, data_capacity);
+		else
+			delete[] data;
+		data = nullptr;
+		data_capacity = 0;
 	}
+	if (chunk) {
+		Pool::free(chunk, chunk_capacity);
+		chunk = nullptr;
+		chunk_capacity = 0;
+	}
+	producer = nullptr;
 }
 
-bool volatile Server::exit_flag = false;
-
-Server::Server() : listen_address("0.0.0.0"), config(0) {
-	work_thread_count = sysconf(_SC_NPROCESSORS_ONLN) * 2;
-}
-
-void Server::thread_process() {
-	Request *request;
-
-	while (!exit_flag) {
-		do {
-			std::unique_lock<std::mutex> in_lock(pending_list.mutex);
-			pending_list.cond.wait(in_lock, [this] {
-				return !(this->pending_list.list.empty()) || exit_flag;
-			});
-			if (exit_flag)
-				return;
-			if (server_events.onPick) {
-				std::list<Request*>::iterator it = server_events.onPick(pending_list.list);
-				request = *it;
-				pending_list.list.erase(it);
-			} else {
-				/* default choose first one to process */
-				request = pending_list.list.front();
-				pending_list.list.pop_front();
+int Response::prepare_iovec(struct iovec* iov) {
+	int count = 0;
+	if (header_has_written < header_size) {
+		iov[count].iov_base = header_buf + header_has_written;
+		iov[count].iov_len = header_size - header_has_written;
+		count++;
+	}
+	unsigned int length = get_length();
+	if (producer) {
+		/* the next chunk is produced when the previous one is written */
+		if (chunk_written == chunk_size && produced < length) {
+			if (chunk == nullptr) {
+				chunk = (char*)Pool::alloc(CHUNK_SIZE, chunk_capacity);
+				assert(chunk);
 			}
-
-			mature_list.lock();
-			mature_list.list.push_back(request);
-			mature_list.unlock();
-		} while (false);
-
-		request->response = new Response(request);
-		assert(request->response);
-		if (!server_events.onRequest || !server_events.onRequest(request)) {
-				request->discard = true;
-				request->matured = true;
+			size_t size = std::min(chunk_capacity, (size_t)(length - produced));
+			ssize_t n = producer(chunk, size);
+			if (n <= 0 || (size_t)n > size)
+				return -1;
+			chunk_size = n;
+			chunk_written = 0;
+			produced += n;
+		}
+		if (chunk_written < chunk_size) {
+			iov[count].iov_base = chunk + chunk_written;
+			iov[count].iov_len = chunk_size - chunk_written;
+			count++;
 		}
+	} else if (file_fd >= 0 && map == nullptr) {
+		/* the body goes by sendfile after the header is written */
+	} else if (body_has_written < length) {
+		iov[count].iov_base = data + body_has_written;
+		iov[count].iov_len = length - body_has_written;
+		count++;
 	}
+	return count;
 }
 
-void Server::set_non_blocking(int sock) {
-	int opts;
-	opts = fcntl(sock, F_GETFL);
-	if (opts < 0) {
-		perror("fcntl/GETFL");
-		exit(1);
+size_t Response::consume(size_t size) {
+	size_t taken = 0;
+	if (header_has_written < header_size) {
+		int n = std::min((size_t)(header_size - header_has_written), size);
+		header_has_written += n;
+		size -= n;
+		taken += n;
 	}
-	opts = opts | O_NONBLOCK;
-	if (fcntl(sock, F_SETFL, opts) < 0) {
-		perror("fcntl/SETFL");
-		exit(2);
+	size_t n = std::min((size_t)(get_length() - body_has_written), size);
+	if (producer) {
+		n = std::min(chunk_size - chunk_written, n);
+		chunk_written += n;
 	}
+	body_has_written += n;
+	taken += n;
+	return taken;
 }
 
-/*
- * create premuture entry for specific handle and one request
- * should always keep premuture has a request entry until handle is closed
-*/
-void Server::create_premature_entry(int handle) {
-	assert(premature_map.find(handle) == premature_map.end());
-	Request* request = new Request(this, handle);
-	assert(request);
-	premature_map[handle] = request;
-}
+Request* const Connection::CLOSED = reinterpret_cast<Request*>(1);
 
-Request* Server::get_handle_request(int handle) {
-	assert(premature_map.find(handle) != premature_map.end());
-	return premature_map[handle];
+Connection::Connection(Reactor* r, int h) : reactor(r), handle(h), 
+		refs(1), completed(nullptr), reading(nullptr),
+		read_sequence(0), send_sequence(0), write_pending(false),
+		read_ms(0), frame_ms(0), write_ms(0), notified(false),
+		next_notified(nullptr), send_inflight(false), recv_armed(false),
+		inflight_requests(0), inflight_bytes(0), paused(false), leaving(false),
+		shm(nullptr) {
 }
 
-Response* Server::get_handle_response(int handle) {
-	Request *request;
-	std::unordered_map<int,Request*>::iterator it = sending_map.find(handle);
-	if (it == sending_map.end()) {
-		request = move_sending_request(handle);
-		if (request) {
-			return request->response;
-		}
-		return nullptr;
-	}
-	request = it->second;
-	return request->response;
+/* the segment is unmapped with the last reference, work threads may 
+ * still check shm of the connection
+*/
+Connection::~Connection() {
+	delete shm;
 }
 
 /*
- * called from net thread, release or mark specific handle request in lists or maps
+ * called from work thread or net thread, push the request to completed stack.
+ * if the connection has been closed, the request is deleted here.
+ * return true if the stack was empty, the reactor needs to be waked up
 */
-void Server::clear_handle(int handle) {
-	/* clear handle entry from premature_map */
-	assert(premature_map.find(handle) != premature_map.end());
-	Request *request = premature_map[handle];
-	delete request;
-	premature_map.erase(handle);
-
-	/* clear handle in pending list yet not processing in work thread */
-	pending_list.lock();
-	std::list<Request*>::iterator it = pending_list.list.begin();
-	while (it != pending_list.list.end()) {
-		if ((*it)->handle == handle) {
-			it = pending_list.list.erase(it);
-			delete (*it);
-		} else 
-			++it;
-	}
-	pending_list.unlock();
-
-	/* mark discard in mature list */
-	mature_list.lock();
-	it = mature_list.list.begin();
-	while (it != mature_list.list.end()) {
-		if ((*it)->handle == handle) {
-			if ((*it)->matured) {
-				/* delete immediate if mature */
-				delete (*it);
-				it = mature_list.list.erase(it);
-			} else {
-				/* mark discard at not mature request, will be delete 
-				 * on sending list picking 
-				*/
-				(*it)->discard = true;
-				++it;
-			}
-		} else {
-			++it;
+bool Connection::push_completed(Request* request) {
+	Request* head = completed.load(std::memory_order_relaxed);
+	do {
+		if (head == CLOSED) {
+			delete request;
+			return false;
 		}
-	}
-	mature_list.unlock();
+		request->next_completed = head;
+	} while (!completed.compare_exchange_weak(head, request, 
+				std::memory_order_release, std::memory_order_relaxed));
+	return head == nullptr;
 }
 
 /*
- * called from net thread, at EPOLLINT calling, 
- * after receive one complete request,
- * that request will be moved to pending list for work thread to pick up,
- * and premature map will create a new empty request for the handle
+ * called from net thread, take all from completed stack into ready queue,
+ * when RESPONSE_ORDERLY is set, ready queue is a window started from 
+ * send_sequence, the request is put at its slot, the slot not matured is nullptr
 */
-void Server::move_premature_request(int handle) {
-	assert(premature_map.find(handle) != premature_map.end());
-	Request* request = premature_map[handle];
-
-	pending_list.lock();
-	pending_list.list.push_back(request);
-	pending_list.unlock();
-	
-	request = new Request(this, handle);
-	assert(request);
-	premature_map[handle] = request;
+void Connection::collect_completed() {
+	Request* head = completed.exchange(nullptr, std::memory_order_acquire);
+	Request* list = nullptr;
+	/* reverse stack to completing order */
+	while (head != nullptr) {
+		Request* next = head->next_completed;
+		head->next_completed = list;
+		list = head;
+		head = next;
+	}
+	bool orderly = reactor->server->config & Server::RESPONSE_ORDERLY;
+	while (list != nullptr) {
+		Request* request = list;
+		list = list->next_completed;
+		request->next_completed = nullptr;
+		if (orderly) {
+			size_t slot = request->sequence - send_sequence;
+			if (slot >= ready.size())
+				ready.resize(slot + 1, nullptr);
+			ready[slot] = request;
+		} else if (request->discard) {
+			reactor->metrics.discarded.add();
+			reactor->finish_request(this, request);
+			delete request;
+			continue;
+		} else
+			ready.push_back(request);
+		if (!request->discard)
+			reactor->wait_send++;
+	}
 }
 
 /*
- * called from net thread, at EPOLLOUT calling
- * after complete sending previous response, it check mature list,
- * 1, skip un-matured request
- * 2, delete matured + discard request
- * 3, move one of specific handle request to sending_map from mature list
+ * called from net thread, when gathering responses to write,
+ * pick the next matured request of the connection to sending queue,
+ * 1, delete matured + discard request
+ * 2, with RESPONSE_ORDERLY, wait if the next sequence is not matured
  * return nullptr indicate no eligible request to move
 */
-Request* Server::move_sending_request(int handle) {
-	Request *request;
-	assert(sending_map.find(handle) == sending_map.end());
-	
-	mature_list.lock();
-	std::list<Request*>::iterator it = mature_list.list.begin();
-	while (it != mature_list.list.end()) {
-		request = *it;
-		if (request->discard && request->matured) {
-			it = mature_list.list.erase(it);
+Request* Connection::move_sending_request() {
+	if (ready.empty() || ready.front() == nullptr)
+		collect_completed();
+	while (!ready.empty() && ready.front() != nullptr) {
+		Request* request = ready.front();
+		ready.pop_front();
+		send_sequence++;
+		if (request->discard) {
+			reactor->metrics.discarded.add();
+			reactor->finish_request(this, request);
 			delete request;
 			continue;
 		}
-		if (request->handle != handle) {
-			++it;
-			continue;
-		} 
-		if (!request->matured) {
-			/* if ORDERLY response is set, 
-			 *	have to wait the first mature, so return nullptr
-			*/
-			if (config & RESPONSE_ORDERLY) {
-				mature_list.unlock();
-				return nullptr;
-			} else {
-				++it;
-				continue;
-			}
-		}
-		mature_list.list.erase(it);
-		sending_map[handle] = request;
-		break;
+		/* the write timeout counts from the first response on the wire */
+		if (sending.empty())
+			write_ms = reactor->loop_ms;
+		sending.push_back(request);
+		return request;
 	}
-	if (it == mature_list.list.end())
-		request = nullptr;
-	mature_list.unlock();
-	return request;
-}
-
-void Server::notify_working() {
-	pending_list.cond.notify_one();
+	return nullptr;
 }
 
 /*
- * called from net thread, close connection
+ * called from net thread, mark the completed stack CLOSED, then release 
+ * all requests held by the connection, requests still in work threads 
+ * will be deleted when they complete
 */
-void Server::close_connection(int handle) {
-	::close(handle);
+void Connection::close() {
+	Request* head = completed.exchange(CLOSED, std::memory_order_acquire);
+	while (head != nullptr) {
+		Request* next = head->next_completed;
+		delete head;
+		head = next;
+	}
+	if (reading != nullptr) {
+		/* a stream cut in the middle ends with no data */
+		if (reading->streaming && reading->body_has_read > 0 && !reading->is_full())
+			reactor->server->server_events.onStream(reading, nullptr, 0, true);
+		delete reading;
+		reading = nullptr;
+	}
+	/* the writev in flight still refers the buffers, released when it ends */
+	if (!send_inflight)
+		release_sending();
+	std::for_each(ready.begin(), ready.end(), [this](Request* r) {
+		if (r != nullptr) {
+			if (!r->discard)
+				this->reactor->wait_send--;
+			delete r;
+		}
+	});
+	ready.clear();
 }
 
-/*
- * called from net thread, epoll add
-*/
-void Server::epoll_add_socket(int sock, int op) {
-	struct epoll_event ev;
-	ev.data.fd = sock;
-	ev.events = op;
-	::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+void Connection::release_sending() {
+	std::for_each(sending.begin(), sending.end(), [this](Request* r) {
+		this->reactor->wait_send--;
+		delete r;
+	});
+	sending.clear();
+}
+
+PendingRing::PendingRing() : cells(nullptr), mask(0), 
+		enqueue_pos(0), dequeue_pos(0) {
+}
+
+PendingRing::~PendingRing() {
+	if (cells)
+		delete[] cells;
+}
+
+void PendingRing::init(size_t capacity) {
+	size_t size = 2;
+	while (size < capacity)
+		size <<= 1;
+	if (cells)
+		delete[] cells;
+	cells = new Cell[size];
+	assert(cells);
+	for (size_t i = 0; i < size; i++) {
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+		cells[i].request = nullptr;
+	}
+	mask = size - 1;
+	enqueue_pos.store(0, std::memory_order_relaxed);
+	dequeue_pos.store(0, std::memory_order_relaxed);
 }
 
 /*
- * called from net thread, epoll delete
+ * the cell is free for position pos when its sequence equals pos,
+ * after filling, the sequence becomes pos + 1 and is ready to pop
 */
-void Server::epoll_delete_socket(int sock) {
-	::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+bool PendingRing::push(Request* request) {
+	Cell *cell;
+	size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+	while (true) {
+		cell = &cells[pos & mask];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+	cell->request = request;
+	cell->sequence.store(pos + 1, std::memory_order_release);
+	return true;
 }
 
 /*
- * called from net thread or work thread, epoll modify
+ * the cell is ready for position pos when its sequence equals pos + 1,
+ * after taking, the sequence becomes pos + capacity for next round push
 */
-void Server::epoll_modify_socket(int sock, int op) {
-	struct epoll_event ev;
-	ev.data.fd = sock;
-	ev.events = op;
-	::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &ev);
+Request* PendingRing::pop() {
+	Cell *cell;
+	size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+	while (true) {
+		cell = &cells[pos & mask];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return nullptr;
+		} else {
+			pos = dequeue_pos.load(std::memory_order_relaxed);
+		}
+	}
+	Request* request = cell->request;
+	cell->sequence.store(pos + mask + 1, std::memory_order_release);
+	return request;
 }
 
-void Server::prepare_exit() {
-	exit_flag = true;
+bool volatile Server::exit_flag = false;
+
+Server::Server() : listen_address("0.0.0.0"), config(0),
+		io_backend(IO_EPOLL), use_pending_ring(true), scheduler(nullptr), pending_capacity(64 * 1024), parked_count(0) {
+	work_thread_count = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+	io_thread_count = 1;
+	write_iov_count = 64;
+	write_bytes = 256 * 1024;
+	connection_limit_requests = 0;
+	connection_limit_bytes = 0;
+	server_limit_requests = 0;
+	server_limit_bytes = 0;
+	inflight_requests = 0;
+	inflight_bytes = 0;
+	stream_threshold = 1024 * 1024;
+	request_batch_max = 32;
+	request_batch_linger_us = 0;
+	idle_timeout_ms = 0;
+	header_timeout_ms = 0;
+	body_timeout_ms = 0;
+	write_timeout_ms = 0;
+	request_timeout_ms = 0;
+	handoff_drain_ms = 0;
+	handoff_listen_fd = -1;
+	handoff_fd = -1;
+	handing_off = false;
+	handoff_left = 0;
+	handoff_deadline_ms = 0;
+	takeover_fd = -1;
+	adopt_next = 0;
+	shm_ring_bytes = 0;
+	shm_listen_fd = -1;
+	shm_next = 0;
 }
 
-/* release remain free all remain handle and request before server exit */
-void Server::release_remain() {
-	std::for_each(premature_map.begin(), premature_map.end(), [](std::pair<int,Request*> p) {
-		/* close handle and release request */
-		::close(p.first);	
-		delete p.second;
-	});
-	std::for_each(sending_map.begin(), sending_map.end(), [](std::pair<int,Request*> p) {
-		/* don't need to close handle, because premature should close all handle */
-		delete p.second;
-	});
-	std::for_each(pending_list.list.begin(), pending_list.list.end(), [](Request* r) {
+Server::~Server() {
+	std::for_each(reactors.begin(), reactors.end(), [](Reactor* r) {
 		delete r;
 	});
-	std::for_each(mature_list.list.begin(), mature_list.list.end(), [](Request* r) {
-		delete r;
+	delete scheduler;
+	std::for_each(workers.begin(), workers.end(), [](WorkerQueue* w) {
+		delete w;
 	});
+	if (handoff_listen_fd >= 0)
+		::close(handoff_listen_fd);
+	if (handoff_fd >= 0)
+		::close(handoff_fd);
+	if (takeover_fd >= 0)
+		::close(takeover_fd);
+	if (shm_listen_fd >= 0)
+		::close(shm_listen_fd);
 }
 
-void Server::dump_state() {
-	cout << "Conn: " << premature_map.size();
-	cout << " Unprocess: " << pending_list.list.size();
-	cout << " WaitSend: " << mature_list.list.size();
-	cout << endl;
-}
+void Server::thread_process(int index) {
+	bool batch_mode = !server_events.onRequest && server_events.onRequestBatch;
+	std::vector<Request*> batch(batch_mode ? request_batch_max : 1);
 
-static void server_interrupt(int) {
-	Server::prepare_exit();
+	while (!exit_flag) {
+		size_t count = pick_pending(index, batch.data(), batch.size(), true);
+		if (count == 0)
+			return;
+		if (batch_mode && count < batch.size() && request_batch_linger_us > 0) {
+			/* wait a little to fill the batch */
+			uint64_t until = clock_ns() + request_batch_linger_us * 1000ULL;
+			while (count < batch.size() && !exit_flag && clock_ns() < until) {
+				size_t n = pick_pending(index, batch.data() + count, batch.size() - count, false);
+				if (n == 0)
+					std::this_thread::yield();
+				count += n;
+			}
+		}
+
+		size_t ready = 0;
+		for (size_t i = 0; i < count; i++) {
+			Request* request = batch[i];
+			/* the handle has been closed, no need to process */
+			if (request->connection->is_closed()) {
+				delete request;
+				continue;
+			}
+			if (!batch_mode) {
+				handle_request(request);
+				continue;
+			}
+			begin_request(request);
+			if (!expire_request(request))
+				batch[ready++] = request;
+		}
+		if (ready > 0)
+			server_events.onRequestBatch(batch.data(), ready);
+	}
 }
 
-int Server::ready(int listen_port, const ServerEvents& on_events) {
-	signal(SIGPIPE, SIG_IGN);
-	signal(SIGINT, server_interrupt);
-	signal(SIGQUIT, server_interrupt);
-	server_events = on_events;
+void Server::begin_request(Request* request) {
+	if (config & STAGE_METRICS)
+		request->picked_ns = clock_ns();
+	request->response = new Response(request);
+	assert(request->response);
+}
 
-	if (on_events.onInit && !on_events.onInit(this)) {
-		return 1;
+void Server::handle_request(Request* request) {
+	begin_request(request);
+	if (expire_request(request))
+		return;
+	if (!server_events.onRequest && server_events.onRequestBatch) {
+		server_events.onRequestBatch(&request, 1);
+		return;
 	}
-	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-	int on = 1;
-	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-
-	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (!server_events.onRequest || !server_events.onRequest(request)) {
+		request->discard = true;
+		request->complete();
+	}
+}
 
-	struct epoll_event ev;
-	ev.data.fd = listen_fd;
-	ev.events = EPOLLIN;
-	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+bool Server::expire_request(Request* request) {
+	if (request->deadline == 0 || clock_ns() < request->deadline)
+		return false;
+	request->expired = true;
+	if (!server_events.onExpired || !server_events.onExpired(request)) {
+		request->discard = true;
+		request->complete();
+	}
+	return true;
+}
 
-	bzero(&server_address, sizeof(server_address));
-	server_address.sin_family = AF_INET;
-	server_address.sin_addr.s_addr = inet_addr(listen_address.c_str());
-	server_address.sin_port = htons(listen_port);
+unsigned int Server::min_timeout_ms() const {
+	unsigned int timeouts[] = { idle_timeout_ms, header_timeout_ms, 
+			body_timeout_ms, write_timeout_ms };
+	unsigned int ms = 0;
+	for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++) {
+		if (timeouts[i] > 0 && (ms == 0 || timeouts[i] < ms))
+			ms = timeouts[i];
+	}
+	return ms;
+}
 
-	if (-1 == bind(listen_fd, (sockaddr*)&server_address, sizeof(server_address))) {
-		perror("bind");
-		exit(1);
+/*
+ * called from net thread, push a framed request to pending queue,
+ * when the ring is full, wait for work threads to make room
+*/
+void Server::push_pending(Request* request) {
+	if (!workers.empty()) {
+		push_worker(request);
+		return;
 	}
-	if (-1 == listen(listen_fd, LISTENQ)) {
-		perror("listen");
-		exit(1);
+	if (!use_pending_ring) {
+		pending_list.lock();
+		if (scheduler)
+			scheduler->push(request);
+		else
+			pending_list.list.push_back(request);
+		pending_list.unlock();
+		return;
 	}
-
-	std::thread* t;
-	for (int i = 0; i < work_thread_count; i++) {
-		t = new std::thread(std::bind(&Server::thread_process, this));
-		threads.push_back(t);
+	while (!pending_ring.push(request)) {
+		if (exit_flag) {
+			delete request;
+			return;
+		}
+		notify_working();
+		std::this_thread::yield();
 	}
+}
 
-	while (!exit_flag) {
-		int nfds = epoll_wait(epoll_fd, events, EVENTSIZE, 300);
-
-		for (int i = 0; i < nfds; i++) {
-			if (events[i].data.fd == listen_fd) {
-				/* connect request */
-				struct sockaddr_in client_address;
-				socklen_t clilen = sizeof(struct sockaddr);
-				int connect_fd = accept(listen_fd, 
-								(struct sockaddr*)&client_address,
-								&clilen);
-				if (connect_fd < 0) {
-					perror("connect_fd");
-					continue;
-				}
-				set_non_blocking(connect_fd);
-				const char* client_ip = inet_ntoa(client_address.sin_addr);
-				if (server_events.onConnected && 
-						!server_events.onConnected(connect_fd, client_ip)) {
-					close_connection(connect_fd);
-					continue;
-				}
-				/* prepare for new request receive */
-				create_premature_entry(connect_fd);
-				epoll_add_socket(connect_fd, EPOLLIN | EPOLLOUT | EPOLLET);
-			} else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
-				/* encounter error */
-				int handle = events[i].data.fd;
-				close_connection(handle);
-				epoll_delete_socket(handle);
-				clear_handle(handle);
-			} else if (events[i].events & EPOLLIN) {
-				/* request data incoming, must receive data until EAGAIN or ERROR
-					because we use ET mode
-				 */
-				int handle = events[i].data.fd;
-				assert(handle >= 0);
-			again:
-				int num_read = read(handle, buffer, BUFFERSIZE);
-				if (num_read < 0) {
-					if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-						continue;
-					}
-					/* maybe errno == ECONNREST ... */
-					perror("read<0");
-					close_connection(handle);
-					epoll_delete_socket(handle);
-					clear_handle(handle);
-					if (server_events.onPeerReset)
-						server_events.onPeerReset(handle);
-					continue;
-				} else if (num_read == 0) {
-					close_connection(handle);
-					epoll_delete_socket(handle);
-					clear_handle(handle);
-					if (server_events.onPeerClosed)
-						server_events.onPeerClosed(handle);
-					continue;
+/*
+ * called from work thread, pick at most max requests to process,
+ * with wait, ring mode spins PENDING_SPIN times before parking on the
+ * condition, otherwise it returns 0 if there is none.
+ * return 0 when server is exiting
+*/
+size_t Server::pick_pending(int index, Request** requests, size_t max, bool wait) {
+	Request *request;
+	size_t count = 0;
+	if (!workers.empty())
+		return pick_worker(index, requests, max, wait);
+	if (!use_pending_ring) {
+		std::unique_lock<std::mutex> in_lock(pending_list.mutex);
+		while (true) {
+			auto has_pending = [this] {
+				return (this->scheduler ? this->scheduler->size() > 0 : 
+						!this->pending_list.list.empty()) || exit_flag;
+			};
+			if (!wait && !has_pending())
+				return 0;
+			pending_list.cond.wait(in_lock, has_pending);
+			if (exit_flag)
+				return 0;
+			if (scheduler) {
+				while (count < max && (request = scheduler->pop()) != nullptr)
+					requests[count++] = request;
+				return count;
+			}
+			while (count < max && !pending_list.list.empty()) {
+				if (server_events.onPick) {
+					std::list<Request*>::iterator it = server_events.onPick(pending_list.list);
+					if (it == pending_list.list.end())
+						break;
+					request = *it;
+					pending_list.list.erase(it);
+				} else {
+					/* default choose first one to process */
+					request = pending_list.list.front();
+					pending_list.list.pop_front();
 				}
-				/* have valid data, fill the unmature request */
-				Request* request = get_handle_request(handle);
-				request->append_data(buffer, num_read, handle, this);
-				goto again;
-			} else if (events[i].events & EPOLLOUT) {
-				/* active sending out response, must write out until EAGAIN or ERROR
-					because ET mode, when one response complete, it will go through
-					mature list to pick a new one.
-					If fail to get one, the EPOLLOUT will be active again by the time 
-					request->end_response called 
-				*/
-				int handle = events[i].data.fd;
-				assert(handle >= 0);
-				Response *response = get_handle_response(handle); 
-				if (response == nullptr)
-					continue;
-				response->write_data(handle, this);
+				requests[count++] = request;
 			}
+			if (count > 0 || !wait)
+				return count;
+			/* onPick picks nothing, wait for the next request */
+			pending_list.cond.wait(in_lock);
 		}
 	}
-	pending_list.cond.notify_all();
-	std::for_each(threads.begin(), threads.end(), [](std::thread* th) {
-		th->join();
-		delete th;
-	});
-	release_remain();
-	if (on_events.onEnd)
-		on_events.onEnd(this);
+
+	int spin = 0;
+	while (!exit_flag) {
+		while (count < max && (request = pending_ring.pop()) != nullptr)
+			requests[count++] = request;
+		if (count > 0 || !wait)
+			return count;
+		if (++spin < PENDING_SPIN) {
+			std::this_thread::yield();
+			continue;
+		}
+		std::unique_lock<std::mutex> in_lock(pending_list.mutex);
+		parked_count.fetch_add(1);
+		pending_list.cond.wait(in_lock, [this] {
+			return this->pending_ring.size() > 0 || exit_flag;
+		});
+		parked_count.fetch_sub(1);
+		spin = 0;
+	}
 	return 0;
 }
 
+void Server::set_non_blocking(int sock) {
+	int opts;
+	opts = fcntl(sock, F_GETFL);
+	if (opts < 0) {
+		perror("fcntl/GETFL");
+		exit(1);
+	}
+	opts = opts | O_NONBLOCK;
+	if (fcntl(sock, F_SETFL, opts) < 0) {
+		perror("fcntl/SETFL");
+		exit(2);
+	}
+}
+
+static void set_option(int sock, int level, int name, int value, const char* what) {
+	if (setsockopt(sock, level, name, &value, sizeof(value)) < 0)
+		perror(what);
+}
+
+/*
+ * the accepted sockets copy the options of their listener in kernel,
+ * so no option is set per connection
+*/
+void Server::apply_socket_options(int sock) {
+	const SocketOptions& o = socket_options;
+	if (o.tcp_nodelay)
+		set_option(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	if (o.rcvbuf > 0)
+		set_option(sock, SOL_SOCKET, SO_RCVBUF, o.rcvbuf, "SO_RCVBUF");
+	if (o.sndbuf > 0)
+		set_option(sock, SOL_SOCKET, SO_SNDBUF, o.sndbuf, "SO_SNDBUF");
+	if (o.defer_accept_s > 0)
+		set_option(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, o.defer_accept_s, "TCP_DEFER_ACCEPT");
+	if (o.busy_poll_us > 0)
+		set_option(sock, SOL_SOCKET, SO_BUSY_POLL, o.busy_poll_us, "SO_BUSY_POLL");
+	if (o.keepalive_idle_s > 0) {
+		set_option(sock, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+		set_option(sock, IPPROTO_TCP, TCP_KEEPIDLE, o.keepalive_idle_s, "TCP_KEEPIDLE");
+		if (o.keepalive_interval_s > 0)
+			set_option(sock, IPPROTO_TCP, TCP_KEEPINTVL, o.keepalive_interval_s, "TCP_KEEPINTVL");
+		if (o.keepalive_count > 0)
+			set_option(sock, IPPROTO_TCP, TCP_KEEPCNT, o.keepalive_count, "TCP_KEEPCNT");
+	}
+}
+
+/*
+ * wake one work thread, in ring mode only when some one has parked,
+ * taking the mutex makes sure the parking thread either sees the request
+ * or is already waiting on the condition
+*/
+void Server::notify_working() {
+	/* workers are waked when the request is pushed */
+	if (!workers.empty())
+		return;
+	if (!use_pending_ring) {
+		pending_list.cond.notify_one();
+		return;
+	}
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (parked_count.load() > 0) {
+		pending_list.lock();
+		pending_list.unlock();
+		pending_list.cond.notify_one();
+	}
+}
+
+/*
+ * called from net thread, push the request to the worker of its handle,
+ * wake the worker if it has parked, or an idle one to steal if the worker
+ * is busy with a backlog
+*/
+void Server::push_worker(Request* request) {
+	WorkerQueue* worker = workers[request->handle % workers.size()];
+	while (!worker->ring.push(request)) {
+		if (exit_flag) {
+			delete request;
+			return;
+		}
+		wake_worker(worker);
+		std::this_thread::yield();
+	}
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (worker->parked.load()) {
+		wake_worker(worker);
+	} else if (parked_count.load() > 0 && worker->ring.size() >= STEAL_BACKLOG) {
+		for (size_t i = 0; i < workers.size(); i++) {
+			if (workers[i]->parked.load()) {
+				wake_worker(workers[i]);
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * called from work thread, take from its own ring first, then steal one,
+ * spins PENDING_SPIN times before parking with wait, return 0 when server 
+ * is exiting
+*/
+size_t Server::pick_worker(int index, Request** requests, size_t max, bool wait) {
+	WorkerQueue* worker = workers[index];
+	Request* request;
+	size_t count = 0;
+	int spin = 0;
+	while (!exit_flag) {
+		while (count < max && (request = worker->ring.pop()) != nullptr)
+			requests[count++] = request;
+		if (count == 0 && (request = steal_worker(index)) != nullptr)
+			requests[count++] = request;
+		if (count > 0 || !wait)
+			return count;
+		if (++spin < PENDING_SPIN) {
+			std::this_thread::yield();
+			continue;
+		}
+		std::unique_lock<std::mutex> in_lock(worker->mutex);
+		worker->parked.store(true);
+		parked_count.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		worker->cond.wait(in_lock, [worker] {
+			return worker->ring.size() > 0 || worker->wake || exit_flag;
+		});
+		worker->wake = false;
+		worker->parked.store(false);
+		parked_count.fetch_sub(1);
+		spin = 0;
+	}
+	return 0;
+}
+
+/* take one from the next worker with a backlog */
+Request* Server::steal_worker(int index) {
+	size_t count = workers.size();
+	for (size_t i = 1; i < count; i++) {
+		WorkerQueue* victim = workers[(index + i) % count];
+		if (victim->ring.size() < STEAL_BACKLOG)
+			continue;
+		Request* request = victim->ring.pop();
+		if (request != nullptr)
+			return request;
+	}
+	return nullptr;
+}
+
+/* taking the mutex makes sure the parking worker is waiting or sees wake */
+void Server::wake_worker(WorkerQueue* worker) {
+	worker->mutex.lock();
+	worker->wake = true;
+	worker->mutex.unlock();
+	worker->cond.notify_one();
+}
+
+void Server::add_inflight(size_t bytes) {
+	if (server_limit_requests == 0 && server_limit_bytes == 0)
+		return;
+	inflight_requests.fetch_add(1, std::memory_order_relaxed);
+	inflight_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+bool Server::sub_inflight(size_t requests, size_t bytes) {
+	if (server_limit_requests == 0 && server_limit_bytes == 0)
+		return false;
+	size_t old_requests = inflight_requests.fetch_sub(requests, std::memory_order_relaxed);
+	size_t old_bytes = inflight_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+	size_t low_requests = server_limit_requests - server_limit_requests / 4;
+	size_t low_bytes = server_limit_bytes - server_limit_bytes / 4;
+	return (server_limit_requests > 0 && old_requests >= low_requests &&
+			old_requests - requests < low_requests) ||
+		(server_limit_bytes > 0 && old_bytes >= low_bytes &&
+			old_bytes - bytes < low_bytes);
+}
+
+bool Server::over_server_limit(bool low) const {
+	if (server_limit_requests > 0) {
+		size_t limit = server_limit_requests;
+		if (low)
+			limit -= limit / 4;
+		if (inflight_requests.load(std::memory_order_relaxed) >= limit)
+			return true;
+	}
+	if (server_limit_bytes > 0) {
+		size_t limit = server_limit_bytes;
+		if (low)
+			limit -= limit / 4;
+		if (inflight_bytes.load(std::memory_order_relaxed) >= limit)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * called from net thread, server wide in flight has drained, 
+ * every reactor holding paused connections checks them in its loop
+*/
+void Server::wake_paused() {
+	std::for_each(reactors.begin(), reactors.end(), [](Reactor* r) {
+		if (r->paused_count.load() > 0) {
+			r->resume_check = true;
+			r->wakeup();
+		}
+	});
+}
+
+void Server::prepare_exit() {
+	exit_flag = true;
+}
+
+/* release remain free all remain handle and request before server exit */
+void Server::release_remain() {
+	std::for_each(reactors.begin(), reactors.end(), [](Reactor* r) {
+		r->release_remain();
+	});
+	std::for_each(pending_list.list.begin(), pending_list.list.end(), [](Request* r) {
+		delete r;
+	});
+	pending_list.list.clear();
+	Request *request;
+	while (scheduler && (request = scheduler->pop()) != nullptr)
+		delete request;
+	while (use_pending_ring && (request = pending_ring.pop()) != nullptr)
+		delete request;
+	std::for_each(workers.begin(), workers.end(), [](WorkerQueue* w) {
+		Request *r;
+		while ((r = w->ring.pop()) != nullptr)
+			delete r;
+	});
+}
+
+/*
+ * called before reactors open, connect to the process serving handoff_path
+ * and take its listen sockets, return false if there is none
+*/
+bool Server::take_over() {
+	int sock = Handoff::connect_path(handoff_path);
+	if (sock < 0)
+		return false;
+	struct timeval tv = { 5, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	unsigned int type = 0;
+	std::vector<int> fds;
+	if (!Handoff::recv_fds(sock, type, fds) || type != Handoff::LISTEN || fds.empty()) {
+		perror("take over");
+		std::for_each(fds.begin(), fds.end(), [](int fd) { ::close(fd); });
+		::close(sock);
+		return false;
+	}
+	inherited_fds = fds;
+	/* connections come later, as the old process hands them over */
+	set_non_blocking(sock);
+	takeover_fd = sock;
+	return true;
+}
+
+/*
+ * wait for the next process on handoff_path, and for the connections of 
+ * the old one, both in reactor 0
+*/
+void Server::open_handoff() {
+	handoff_listen_fd = Handoff::listen_path(handoff_path);
+	if (handoff_listen_fd < 0) {
+		perror("handoff listen");
+		return;
+	}
+	reactors[0]->watch(handoff_listen_fd, EPOLLIN, [this](unsigned int) { 
+		this->accept_handoff(); 
+	});
+	if (takeover_fd >= 0) {
+		reactors[0]->watch(takeover_fd, EPOLLIN, [this](unsigned int) { 
+			this->receive_handoff(); 
+		});
+	}
+}
+
+/*
+ * called from reactor 0, the next process has connected
+*/
+void Server::accept_handoff() {
+	int sock = accept4(handoff_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+	if (sock < 0) {
+		perror("handoff accept");
+		reactors[0]->watch(handoff_listen_fd, EPOLLIN, [this](unsigned int) { 
+			this->accept_handoff(); 
+		});
+		return;
+	}
+	begin_handoff(sock);
+}
+
+/*
+ * send the listen sockets, then every reactor stops accepting and hands 
+ * over its connections as they go idle, see Reactor::run_handoff
+*/
+void Server::begin_handoff(int sock) {
+	/* a process is handed over once */
+	::close(handoff_listen_fd);
+	handoff_listen_fd = -1;
+	/* a slow receiver must not stall the reactors, see send_handoff */
+	set_non_blocking(sock);
+	std::vector<int> fds;
+	for (size_t i = 0; i < reactors.size() && i < (size_t)Handoff::MAX_FDS; i++)
+		fds.push_back(reactors[i]->listen_fd);
+	if (!Handoff::send_fds(sock, Handoff::LISTEN, fds.data(), (int)fds.size())) {
+		perror("handoff listen sockets");
+		::close(sock);
+		return;
+	}
+	handoff_fd = sock;
+	handoff_left = (int)reactors.size();
+	handoff_deadline_ms = clock_ns() / 1000000 + handoff_drain_ms;
+	handing_off = true;
+	std::for_each(reactors.begin(), reactors.end(), [](Reactor* r) {
+		r->wakeup();
+	});
+}
+
+bool Server::send_handoff(const int* fds, int count) {
+	std::lock_guard<std::mutex> lock(handoff_mutex);
+	if (handoff_fd < 0) {
+		errno = EPIPE;
+		return false;
+	}
+	if (!Handoff::send_fds(handoff_fd, Handoff::CONNECTIONS, fds, count)) {
+		if (errno == EAGAIN)
+			return false;
+		perror("handoff connections");
+		::close(handoff_fd);
+		handoff_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+void Server::end_handoff() {
+	{
+		std::lock_guard<std::mutex> lock(handoff_mutex);
+		if (handoff_fd >= 0) {
+			::close(handoff_fd);
+			handoff_fd = -1;
+		}
+	}
+	prepare_exit();
+	std::for_each(reactors.begin(), reactors.end(), [](Reactor* r) {
+		r->wakeup();
+	});
+}
+
+/*
+ * called from reactor 0, take the connections handed over by the old 
+ * process, they are spread over the reactors
+*/
+void Server::receive_handoff() {
+	for (;;) {
+		unsigned int type = 0;
+		std::vector<int> fds;
+		if (!Handoff::recv_fds(takeover_fd, type, fds)) {
+			std::for_each(fds.begin(), fds.end(), [](int fd) { ::close(fd); });
+			if (errno == EAGAIN) {
+				reactors[0]->watch(takeover_fd, EPOLLIN, [this](unsigned int) { 
+					this->receive_handoff(); 
+				});
+				return;
+			}
+			/* the old process has exited */
+			if (errno != 0)
+				perror("take over connections");
+			::close(takeover_fd);
+			takeover_fd = -1;
+			return;
+		}
+		if (type != Handoff::CONNECTIONS) {
+			std::for_each(fds.begin(), fds.end(), [](int fd) { ::close(fd); });
+			continue;
+		}
+		std::for_each(fds.begin(), fds.end(), [this](int fd) {
+			Reactor* r = this->reactors[this->adopt_next++ % this->reactors.size()];
+			r->post([r, fd]() { r->adopt_connection(fd); }, 0);
+		});
+	}
+}
+
+/*
+ * clients on this host connect to shm_path, reactor 0 accepts them
+*/
+void Server::open_shm() {
+	if (reactors[0]->epoll_fd < 0) {
+		cerr << "shared memory transport needs the epoll backend" << endl;
+		return;
+	}
+	shm_listen_fd = Handoff::listen_path(shm_path, socket_options.backlog);
+	if (shm_listen_fd < 0) {
+		perror("shm listen");
+		return;
+	}
+	set_non_blocking(shm_listen_fd);
+	reactors[0]->watch(shm_listen_fd, EPOLLIN, [this](unsigned int) { 
+		this->accept_shm(); 
+	});
+}
+
+/*
+ * called from reactor 0, the connections are spread over the reactors,
+ * which set up their segments
+*/
+void Server::accept_shm() {
+	for (;;) {
+		int sock = accept4(shm_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("shm accept");
+			break;
+		}
+		Reactor* r = reactors[shm_next++ % reactors.size()];
+		r->post([r, sock]() { r->adopt_shm(sock); }, 0);
+	}
+	reactors[0]->watch(shm_listen_fd, EPOLLIN, [this](unsigned int) { 
+		this->accept_shm(); 
+	});
+}
+
+MetricsSnapshot Server::get_metrics() {
+	MetricsSnapshot snapshot;
+	std::for_each(reactors.begin(), reactors.end(), [&](Reactor* r) {
+		snapshot.add(r->metrics);
+		snapshot.wait_send += r->wait_send.load(std::memory_order_relaxed);
+		snapshot.paused += r->paused_count.load(std::memory_order_relaxed);
+	});
+	if (!workers.empty()) {
+		std::for_each(workers.begin(), workers.end(), [&](WorkerQueue* w) {
+			snapshot.pending += w->ring.size();
+		});
+	} else if (use_pending_ring) {
+		snapshot.pending = pending_ring.size();
+	} else {
+		pending_list.lock();
+		snapshot.pending = scheduler ? scheduler->size() : pending_list.list.size();
+		pending_list.unlock();
+	}
+	return snapshot;
+}
+
+void Server::dump_state() {
+	MetricsSnapshot snapshot = get_metrics();
+	cout << "Conn: " << snapshot.connections;
+	cout << " Unprocess: " << snapshot.pending;
+	cout << " WaitSend: " << snapshot.wait_send;
+	cout << " In: " << snapshot.frames_in;
+	cout << " Out: " << snapshot.frames_out;
+	cout << endl;
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		if (snapshot.stages[i].count() > 0)
+			cout << "  " << MetricsSnapshot::stage_name(i) << "(us) " <<
+				snapshot.stages[i].summary(1000) << endl;
+	}
+}
+
+static void server_interrupt(int) {
+	Server::prepare_exit();
+}
+
+int Server::ready(int listen_port, const ServerEvents& on_events) {
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, server_interrupt);
+	signal(SIGQUIT, server_interrupt);
+	server_events = on_events;
+
+	if (on_events.onInit && !on_events.onInit(this)) {
+		return 1;
+	}
+	use_pending_ring = !server_events.onPick && !scheduler;
+	if (use_pending_ring && (config & WORKER_AFFINITY) && work_thread_count > 0) {
+		/* the rings of workers share the pending capacity */
+		size_t capacity = std::max(pending_capacity / work_thread_count, (size_t)1024);
+		for (int i = 0; i < work_thread_count; i++) {
+			WorkerQueue* worker = new WorkerQueue();
+			assert(worker);
+			worker->ring.init(capacity);
+			workers.push_back(worker);
+		}
+		use_pending_ring = false;
+	} else if (use_pending_ring)
+		pending_ring.init(pending_capacity);
+
+	if (!handoff_path.empty() && take_over())
+		io_thread_count = std::max(io_thread_count, (int)inherited_fds.size());
+
+	bzero(&server_address, sizeof(server_address));
+	server_address.sin_family = AF_INET;
+	server_address.sin_addr.s_addr = inet_addr(listen_address.c_str());
+	server_address.sin_port = htons(listen_port);
+
+	for (int i = 0; i < io_thread_count; i++) {
+		Reactor* reactor = new Reactor(this, i);
+		assert(reactor);
+		reactors.push_back(reactor);
+		if (!reactor->open(listen_port))
+			exit(1);
+	}
+	if (!handoff_path.empty())
+		open_handoff();
+	if (!shm_path.empty())
+		open_shm();
+
+	std::thread* t;
+	for (int i = 0; i < work_thread_count; i++) {
+		t = new std::thread(std::bind(&Server::thread_process, this, i));
+		threads.push_back(t);
+	}
+	for (int i = 1; i < io_thread_count; i++) {
+		reactors[i]->thread = new std::thread(std::bind(&Reactor::run, reactors[i]));
+	}
+
+	/* reactor 0 runs in current thread */
+	reactors[0]->run();
+
+	for (int i = 1; i < io_thread_count; i++) {
+		reactors[i]->thread->join();
+		delete reactors[i]->thread;
+		reactors[i]->thread = nullptr;
+	}
+	pending_list.lock();
+	pending_list.unlock();
+	pending_list.cond.notify_all();
+	std::for_each(workers.begin(), workers.end(), [](WorkerQueue* w) {
+		w->mutex.lock();
+		w->mutex.unlock();
+		w->cond.notify_all();
+	});
+	std::for_each(threads.begin(), threads.end(), [](std::thread* th) {
+		th->join();
+		delete th;
+	});
+	threads.clear();
+	release_remain();
+	if (on_events.onEnd)
+		on_events.onEnd(this);
+	return 0;
+}
+
+Reactor::Reactor(Server* s, int i) : server(s), index(i), 
+		epoll_fd(-1), listen_fd(-1), wait_send(0), use_sendfile(true), read_ns(0), 
+		loop_ms(clock_ns() / 1000000), accepting(true), handed_off(false), wake_fd(-1),
+		notified_list(nullptr), posted_list(nullptr), paused_count(0), 
+		resume_check(false),
+#ifdef NEUSC_HAVE_URING
+		uring(nullptr), recv_multishot(true), uring_inflight(0), wake_value(0),
+#endif
+		thread(nullptr) {
+}
+
+Reactor::~Reactor() {
+#ifdef NEUSC_HAVE_URING
+	if (uring)
+		delete uring;
+#endif
+	if (wake_fd >= 0)
+		::close(wake_fd);
+	if (listen_fd >= 0)
+		::close(listen_fd);
+	if (epoll_fd >= 0)
+		::close(epoll_fd);
+}
+
+/*
+ * create the epoll fd and the listen socket of this reactor, 
+ * if there are more than one reactor, every reactor binds its own listen 
+ * socket to the same port with SO_REUSEPORT, and kernel balances the 
+ * incoming connections between them
+*/
+bool Reactor::open(int listen_port) {
+	timers.init(loop_ms, TIMER_TICK_MS);
+	iovecs.resize(server->write_iov_count);
+	if (index < (int)server->inherited_fds.size()) {
+		/* taken over with its backlog, see Server::set_handoff */
+		listen_fd = server->inherited_fds[index];
+		server->set_non_blocking(listen_fd);
+		server->apply_socket_options(listen_fd);
+	} else {
+		/* non-blocking, the backlog is drained until EAGAIN */
+		listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		int on = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		/* the next process may run more reactors on the sockets handed over */
+		if ((server->io_thread_count > 1 || !server->handoff_path.empty()) && 
+				-1 == setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+			perror("SO_REUSEPORT");
+			return false;
+		}
+		/* buffer sizes must be set before listen to take effect on the window scale */
+		server->apply_socket_options(listen_fd);
+
+		if (-1 == bind(listen_fd, (sockaddr*)&server->server_address, 
+					sizeof(server->server_address))) {
+			perror("bind");
+			return false;
+		}
+		if (-1 == listen(listen_fd, server->socket_options.backlog)) {
+			perror("listen");
+			return false;
+		}
+	}
+
+	if (server->io_backend == Server::IO_URING) {
+#ifdef NEUSC_HAVE_URING
+		if (open_uring())
+			return true;
+#endif
+		if (index == 0)
+			cerr << "io_uring is not supported, fall back to epoll" << endl;
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	struct epoll_event ev;
+	ev.data.u64 = (uint32_t)listen_fd;
+	ev.events = EPOLLIN;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wake_fd < 0) {
+		perror("eventfd");
+		return false;
+	}
+	epoll_add_socket(wake_fd, EPOLLIN | EPOLLET);
+	return true;
+}
+
+/*
+ * called from net thread, set up the accepted handle, which is already
+ * non-blocking, return nullptr if onConnected refuses it
+*/
+Connection* Reactor::accept_connection(int handle, const char* client_ip) {
+	ServerEvents& server_events = server->server_events;
+	if (server_events.onConnected && 
+			!server_events.onConnected(handle, client_ip)) {
+		close_connection(handle);
+		return nullptr;
+	}
+	/* prepare for new request receive */
+	metrics.accepted.add();
+	Connection* connection = create_premature_entry(handle);
+	unsigned int timeout = server->min_timeout_ms();
+	if (timeout > 0) {
+		connection->read_ms = loop_ms;
+		connection->write_ms = loop_ms;
+		connection->timer.owner = connection;
+		timers.add(&connection->timer, loop_ms + timeout);
+	}
+	return connection;
+}
+
+/*
+ * create connection for specific handle with one premature request
+ * should always keep connection has a reading request until handle is closed
+*/
+Connection* Reactor::create_premature_entry(int handle) {
+	Connection* connection = new Connection(this, handle);
+	assert(connection);
+	connection->reading = new Request(connection);
+	assert(connection->reading);
+	connections.insert(handle, connection);
+	return connection;
+}
+
+Connection* Reactor::get_connection(int handle) {
+	return connections.get(handle);
+}
+
+/*
+ * called from net thread, release the connection of specific handle,
+ * requests still processing in work thread are deleted when they complete,
+ * requests in pending list are dropped by work thread
+*/
+void Reactor::clear_handle(int handle) {
+	Connection *connection = connections.erase(handle);
+	timers.remove(&connection->timer);
+	/* the client holds the eventfd too, so closing it doesn't unregister it */
+	if (connection->shm != nullptr)
+		::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->shm->server_efd, NULL);
+	if (connection->paused)
+		paused_count--;
+	if (server->sub_inflight(connection->inflight_requests, connection->inflight_bytes))
+		server->wake_paused();
+	connection->close();
+	connection->release();
+	metrics.closed.add();
+}
+
+/*
+ * called from net thread, the peer has closed or reset the handle
+*/
+void Reactor::drop_connection(int handle, bool reset) {
+	ServerEvents& server_events = server->server_events;
+	close_connection(handle);
+	if (epoll_fd >= 0)
+		epoll_delete_socket(handle);
+	clear_handle(handle);
+	if (reset) {
+		if (server_events.onPeerReset)
+			server_events.onPeerReset(handle);
+	} else if (server_events.onPeerClosed)
+		server_events.onPeerClosed(handle);
+}
+
+/*
+ * called from net thread, at EPOLLINT calling, 
+ * after receive one complete request,
+ * that request will be moved to pending list for work thread to pick up,
+ * and connection will create a new empty request for the handle
+*/
+void Reactor::move_premature_request(Connection* connection) {
+	Request* request = connection->reading;
+	request->sequence = connection->read_sequence++;
+	request->read_end_ns = read_ns;
+	metrics.frames_in.add();
+
+	/* a streamed body is not held by the request */
+	request->frame_size = request->header_size;
+	if (!request->streaming)
+		request->frame_size += request->get_length();
+	connection->inflight_requests++;
+	connection->inflight_bytes += request->frame_size;
+	server->add_inflight(request->frame_size);
+	if (!connection->paused && over_limit(connection))
+		pause_connection(connection);
+
+	if (server->request_timeout_ms > 0)
+		request->deadline = (loop_ms + server->request_timeout_ms) * 1000000ULL;
+	request->run_inline = server->config & Server::INLINE_REQUEST;
+	if (server->server_events.onClassify)
+		server->server_events.onClassify(request);
+	if (request->run_inline) {
+		inline_reactor = this;
+		server->handle_request(request);
+		inline_reactor = nullptr;
+	} else {
+		server->push_pending(request);
+		server->notify_working();
+	}
+	
+	request = new Request(connection);
+	assert(request);
+	connection->reading = request;
+}
+
+/*
+ * called from net thread, close connection,
+ * with io_uring the recv in flight holds the socket, shutdown ends it
+*/
+void Reactor::close_connection(int handle) {
+#ifdef NEUSC_HAVE_URING
+	if (uring != nullptr)
+		::shutdown(handle, SHUT_RDWR);
+#endif
+	::close(handle);
+}
+
+/*
+ * called from net thread, epoll add
+*/
+void Reactor::epoll_add_socket(int sock, int op) {
+	struct epoll_event ev;
+	ev.data.u64 = connections.key(sock);
+	ev.events = op;
+	::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+}
+
+/*
+ * called from net thread, epoll delete
+*/
+void Reactor::epoll_delete_socket(int sock) {
+	::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+}
+
+/*
+ * called from net thread, epoll modify
+*/
+void Reactor::epoll_modify_socket(int sock, int op) {
+	struct epoll_event ev;
+	ev.data.u64 = connections.key(sock);
+	ev.events = op;
+	::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &ev);
+}
+
+/*
+ * called from work thread, link the connection to the notified list once,
+ * the reactor is waked up by wake_fd only when the list was empty.
+ * the caller's reference of the connection is taken over by the list
+*/
+void Reactor::notify_completed(Connection* connection) {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (connection->notified.exchange(true)) {
+		connection->release();
+		return;
+	}
+	Connection* head = notified_list.load(std::memory_order_relaxed);
+	do {
+		connection->next_notified = head;
+	} while (!notified_list.compare_exchange_weak(head, connection,
+				std::memory_order_release, std::memory_order_relaxed));
+	if (head == nullptr)
+		wakeup();
+}
+
+void Reactor::wakeup() {
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("write wake_fd");
+}
+
+/*
+ * called from net thread, take the connections notified by work threads,
+ * collect their completed requests and send, all in one pass
+*/
+void Reactor::flush_notified() {
+	Connection* list = notified_list.exchange(nullptr, std::memory_order_acquire);
+	while (list != nullptr) {
+		Connection* connection = list;
+		list = list->next_notified;
+		connection->notified.store(false);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!connection->is_closed()) {
+			connection->collect_completed();
+#ifdef NEUSC_HAVE_URING
+			if (uring != nullptr)
+				uring_send(connection);
+			else
+#endif
+			write_connection(connection);
+		}
+		connection->release();
+	}
+}
+
+bool Reactor::over_limit(Connection* connection) const {
+	return (server->connection_limit_requests > 0 &&
+			connection->inflight_requests >= server->connection_limit_requests) ||
+		(server->connection_limit_bytes > 0 &&
+			connection->inflight_bytes >= server->connection_limit_bytes) ||
+		server->over_server_limit(false);
+}
+
+/* resume below 3/4 of the limits, so a connection doesn't flap at the edge */
+bool Reactor::can_resume(Connection* connection) const {
+	int requests = server->connection_limit_requests;
+	size_t bytes = server->connection_limit_bytes;
+	return (requests == 0 || connection->inflight_requests < requests - requests / 4) &&
+		(bytes == 0 || connection->inflight_bytes < bytes - bytes / 4) &&
+		!server->over_server_limit(true);
+}
+
+/*
+ * called from net thread, the request of a live connection is done,
+ * written out or discarded, give back its in flight share
+*/
+void Reactor::finish_request(Connection* connection, Request* request) {
+	if (request->expired)
+		metrics.expired.add();
+	connection->inflight_requests--;
+	connection->inflight_bytes -= request->frame_size;
+	if (server->sub_inflight(1, request->frame_size))
+		server->wake_paused();
+	if (connection->paused && can_resume(connection))
+		resume_connection(connection);
+}
+
+/*
+ * stop reading the connection, frames already read are still parsed
+*/
+void Reactor::pause_connection(Connection* connection) {
+	connection->paused = true;
+	paused_count++;
+	metrics.pauses.add();
+	/* the ring is left as it is until resumed */
+	if (connection->shm != nullptr)
+		return;
+#ifdef NEUSC_HAVE_URING
+	if (uring != nullptr) {
+		/* if the ring refuses the cancel, the recv is not re-armed when it ends */
+		if (connection->recv_armed)
+			uring_cancel_recv(connection);
+		return;
+	}
+#endif
+	epoll_modify_socket(connection->handle, EPOLLOUT | EPOLLET);
+}
+
+/*
+ * reading goes on, with epoll re-arming EPOLLIN reports the data 
+ * buffered in socket while paused
+*/
+void Reactor::resume_connection(Connection* connection) {
+	connection->paused = false;
+	paused_count--;
+	/* the client doesn't signal while it's not asked to, signal ourselves */
+	if (connection->shm != nullptr) {
+		ShmSegment::signal(connection->shm->server_efd);
+		return;
+	}
+#ifdef NEUSC_HAVE_URING
+	if (uring != nullptr) {
+		if (!connection->recv_armed)
+			uring_recv(connection);
+		return;
+	}
+#endif
+	epoll_modify_socket(connection->handle, EPOLLIN | EPOLLOUT | EPOLLET);
+}
+
+int Reactor::wait_timeout() const {
+	int timeout = timers.size() > 0 || server->handing_off ? TIMER_TICK_MS : 300;
+	if (!task_heap.empty()) {
+		uint64_t now = clock_ns() / 1000000;
+		uint64_t due = task_heap.front()->due_ms;
+		timeout = due <= now ? 0 : (int)std::min<uint64_t>(timeout, due - now);
+	}
+	return timeout;
+}
+
+void Reactor::post(std::function<void()> fn, unsigned int delay_ms) {
+	ReactorTask* task = new ReactorTask();
+	assert(task);
+	task->fd = -1;
+	task->cancel = false;
+	task->events = 0;
+	task->due_ms = delay_ms;
+	task->fn = [fn](unsigned int) { fn(); };
+	post_task(task);
+}
+
+void Reactor::watch(int fd, unsigned int events, std::function<void(unsigned int)> fn) {
+	ReactorTask* task = new ReactorTask();
+	assert(task);
+	task->fd = fd;
+	task->cancel = false;
+	task->events = events;
+	task->due_ms = 0;
+	task->fn = std::move(fn);
+	post_task(task);
+}
+
+/* posted like a watch, so it's ordered after the watch it cancels */
+void Reactor::unwatch(int fd) {
+	ReactorTask* task = new ReactorTask();
+	assert(task);
+	task->fd = fd;
+	task->cancel = true;
+	task->events = 0;
+	task->due_ms = 0;
+	post_task(task);
+}
+
+/*
+ * called from any thread, link the task to the posted list, the reactor
+ * is waked up only when the list was empty
+*/
+void Reactor::post_task(ReactorTask* task) {
+	ReactorTask* head = posted_list.load(std::memory_order_relaxed);
+	do {
+		task->next_posted = head;
+	} while (!posted_list.compare_exchange_weak(head, task, 
+			std::memory_order_release, std::memory_order_relaxed));
+	if (head == nullptr)
+		wakeup();
+}
+
+/*
+ * called from net thread, take the posted tasks in the order they were
+ * posted, run those without delay, and those due in the heap
+*/
+void Reactor::run_posted() {
+	ReactorTask* list = posted_list.exchange(nullptr, std::memory_order_acquire);
+	ReactorTask* ordered = nullptr;
+	while (list != nullptr) {
+		ReactorTask* next = list->next_posted;
+		list->next_posted = ordered;
+		ordered = list;
+		list = next;
+	}
+	uint64_t now = clock_ns() / 1000000;
+	while (ordered != nullptr) {
+		ReactorTask* task = ordered;
+		ordered = ordered->next_posted;
+		if (task->fd >= 0 && task->cancel) {
+			cancel_watch(task->fd);
+			delete task;
+		} else if (task->fd >= 0)
+			add_watch(task);
+		else if (task->due_ms == 0) {
+			task->fn(0);
+			delete task;
+		} else {
+			/* due_ms is the delay until it's in the heap */
+			task->due_ms += now;
+			task_heap.push_back(task);
+			std::push_heap(task_heap.begin(), task_heap.end(), ReactorTask::later);
+		}
+	}
+	run_due_tasks();
+}
+
+void Reactor::run_due_tasks() {
+	if (task_heap.empty())
+		return;
+	uint64_t now = clock_ns() / 1000000;
+	while (!task_heap.empty() && task_heap.front()->due_ms <= now) {
+		std::pop_heap(task_heap.begin(), task_heap.end(), ReactorTask::later);
+		ReactorTask* task = task_heap.back();
+		task_heap.pop_back();
+		task->fn(0);
+		delete task;
+	}
+}
+
+/*
+ * called from net thread, wait for the fd of the task to be ready once,
+ * by a oneshot epoll registration or a poll sqe with io_uring
+*/
+void Reactor::add_watch(ReactorTask* task) {
+	int fd = task->fd;
+	if ((size_t)fd >= watches.size())
+		watches.resize(std::max((size_t)fd + 1, watches.size() * 2), nullptr);
+	bool added = false;
+	if (watches[fd] == nullptr) {
+		watches[fd] = task;
+#ifdef NEUSC_HAVE_URING
+		if (uring != nullptr) {
+			struct io_uring_sqe* sqe = uring_sqe();
+			added = sqe != nullptr;
+			if (added) {
+				sqe->opcode = IORING_OP_POLL_ADD;
+				sqe->fd = fd;
+				sqe->poll32_events = task->events;
+				sqe->user_data = (uint64_t)(uintptr_t)task | URING_POLL;
+			}
+		} else
+#endif
+		{
+			struct epoll_event ev;
+			ev.data.u64 = (uint32_t)fd;
+			ev.events = task->events | EPOLLONESHOT;
+			added = ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+			if (!added)
+				perror("epoll_ctl watch");
+		}
+		if (!added)
+			watches[fd] = nullptr;
+	}
+	if (!added) {
+		task->fn(EPOLLERR);
+		delete task;
+	}
+}
+
+/*
+ * called from net thread, the registration of a closed fd is gone from
+ * epoll, so it's deleted here. a poll sqe keeps the file and ends only
+ * when it's removed, then finish_watch runs with -ECANCELED
+*/
+void Reactor::cancel_watch(int fd) {
+	if (fd < 0 || (size_t)fd >= watches.size() || watches[fd] == nullptr)
+		return;
+#ifdef NEUSC_HAVE_URING
+	if (uring != nullptr) {
+		ReactorTask* task = watches[fd];
+		if (task->cancel)
+			return;
+		struct io_uring_sqe* sqe = uring_sqe();
+		if (sqe == nullptr) {
+			uring_retry.push_back((uint64_t)fd << 3 | URING_POLL);
+			return;
+		}
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = (uint64_t)(uintptr_t)task | URING_POLL;
+		sqe->user_data = URING_CANCEL;
+		task->cancel = true;
+		return;
+	}
+#endif
+	finish_watch(fd, EPOLLERR);
+}
+
+void Reactor::finish_watch(int fd, unsigned int events) {
+	if (fd < 0 || (size_t)fd >= watches.size() || watches[fd] == nullptr)
+		return;
+	ReactorTask* task = watches[fd];
+	watches[fd] = nullptr;
+#ifdef NEUSC_HAVE_URING
+	if (uring == nullptr)
+#endif
+	::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	task->fn(events);
+	delete task;
+}
+
+void Reactor::check_paused() {
+	if (paused_count.load() == 0 || !resume_check.exchange(false))
+		return;
+	connections.for_each([this](int handle, Connection* connection) {
+		if (connection->paused && this->can_resume(connection))
+			this->resume_connection(connection);
+	});
+}
+
+/*
+ * called from net thread, check the connections whose timer expires,
+ * a connection is timed by one timer, which is set to the time it may
+ * time out and checked again then, so reading and writing don't touch it
+*/
+/* advance also while empty, so the wheel never lags behind the clock */
+void Reactor::run_timers() {
+	Timer* timer = timers.advance(loop_ms);
+	while (timer != nullptr) {
+		Timer* next = timer->next;
+		check_timeout(static_cast<Connection*>(timer->owner));
+		timer = next;
+	}
+}
+
+void Reactor::check_timeout(Connection* connection) {
+	uint64_t due = timeout_of(connection);
+	if (due <= loop_ms) {
+		metrics.timeouts.add();
+		drop_connection(connection->handle, true);
+		return;
+	}
+	/* check again at the shortest timeout if none counts now */
+	timers.add(&connection->timer, std::min(due, loop_ms + server->min_timeout_ms()));
+}
+
+uint64_t Reactor::timeout_of(Connection* connection) const {
+	uint64_t due = UINT64_MAX;
+	Request* request = connection->reading;
+	bool reading = request != nullptr && request->header_has_read > 0;
+	if (reading && !connection->paused) {
+		if (request->header_has_read < request->header_size) {
+			if (server->header_timeout_ms > 0)
+				due = std::min(due, connection->frame_ms + server->header_timeout_ms);
+		} else if (server->body_timeout_ms > 0)
+			due = std::min(due, connection->read_ms + server->body_timeout_ms);
+	}
+	if (!connection->sending.empty() && server->write_timeout_ms > 0)
+		due = std::min(due, connection->write_ms + server->write_timeout_ms);
+	if (!reading && connection->sending.empty() && connection->inflight_requests == 0 &&
+			server->idle_timeout_ms > 0) {
+		due = std::min(due, std::max(connection->read_ms, connection->write_ms) + 
+				server->idle_timeout_ms);
+	}
+	return due;
+}
+
+/*
+ * called from net thread, the listen socket has been handed over, the
+ * connections queued on it are accepted by the next process
+*/
+void Reactor::stop_accept() {
+	accepting = false;
+#ifdef NEUSC_HAVE_URING
+	if (uring != nullptr)
+		uring_cancel_accept();
+	else
+#endif
+	epoll_delete_socket(listen_fd);
+	::close(listen_fd);
+	listen_fd = -1;
+}
+
+bool Reactor::is_idle(Connection* connection) const {
+	return connection->reading->header_has_read == 0 && 
+		connection->inflight_requests == 0 && connection->sending.empty() &&
+		connection->ready.empty() && connection->completed.load() == nullptr &&
+		!connection->send_inflight && !connection->recv_armed && !connection->paused;
+}
+
+/*
+ * called from net thread while handing off, send the idle connections to
+ * the next process, the rest are checked again every loop until they're
+ * idle or the drain times out
+*/
+void Reactor::run_handoff() {
+	if (accepting)
+		stop_accept();
+	if (handed_off)
+		return;
+	std::vector<int> idle;
+	std::vector<int> local;
+	connections.for_each([this, &idle, &local](int handle, Connection* connection) {
+#ifdef NEUSC_HAVE_URING
+		/* the recv in flight may take data, it's canceled first */
+		if (uring != nullptr && connection->recv_armed && !connection->leaving &&
+				connection->reading->header_has_read == 0) {
+			/* tried again on the next loop if the ring refused it */
+			if (uring_cancel_recv(connection))
+				connection->leaving = true;
+			return;
+		}
+#endif
+		if (is_idle(connection))
+			(connection->shm != nullptr ? local : idle).push_back(handle);
+	});
+	/* the segment can't be handed over, the clients connect again */
+	std::for_each(local.begin(), local.end(), [this](int handle) {
+		this->drop_connection(handle, false);
+	});
+	for (size_t i = 0; i < idle.size(); i += Handoff::MAX_FDS) {
+		int count = (int)std::min(idle.size() - i, (size_t)Handoff::MAX_FDS);
+		/* if the channel fails, close them, the clients connect again.
+			if it's full, they stay idle here and are sent on the next loop
+		*/
+		bool sent = server->send_handoff(idle.data() + i, count);
+		if (!sent && errno == EAGAIN)
+			break;
+		for (int j = 0; j < count; j++) {
+			if (sent)
+				leave_connection(idle[i + j]);
+			else
+				drop_connection(idle[i + j], false);
+		}
+	}
+	if (connections.size() == 0 || loop_ms >= server->handoff_deadline_ms) {
+		handed_off = true;
+		if (--server->handoff_left == 0)
+			server->end_handoff();
+	}
+}
+
+/*
+ * the next process has a duplicate of the handle, close ours without
+ * shutdown, which would end it for both
+*/
+void Reactor::leave_connection(int handle) {
+	if (epoll_fd >= 0)
+		epoll_delete_socket(handle);
+	clear_handle(handle);
+	::close(handle);
+	if (server->server_events.onPeerClosed)
+		server->server_events.onPeerClosed(handle);
+}
+
+/*
+ * called from net thread, serve a connection handed over by the old process
+*/
+void Reactor::adopt_connection(int handle) {
+	struct sockaddr_in client_address;
+	socklen_t clilen = sizeof(client_address);
+	memset(&client_address, 0, sizeof(client_address));
+	getpeername(handle, (struct sockaddr*)&client_address, &clilen);
+	const char* client_ip = inet_ntoa(client_address.sin_addr);
+	server->set_non_blocking(handle);
+	Connection* connection = accept_connection(handle, client_ip);
+	if (connection == nullptr)
+		return;
+#ifdef NEUSC_HAVE_URING
+	if (uring != nullptr) {
+		uring_recv(connection);
+		return;
+	}
+#endif
+	/* data buffered in the socket is reported by the first EPOLLIN */
+	epoll_add_socket(handle, EPOLLIN | EPOLLOUT | EPOLLET);
+}
+
+/*
+ * called from net thread, a client on this host has connected to shm_path,
+ * send it the segment, then its requests are signaled by server_efd
+*/
+void Reactor::adopt_shm(int handle) {
+	ShmSegment* shm = new ShmSegment();
+	assert(shm);
+	if (!shm->create(server->shm_ring_bytes)) {
+		delete shm;
+		::close(handle);
+		return;
+	}
+	int fds[3] = { shm->memfd, shm->server_efd, shm->client_efd };
+	if (!Handoff::send_fds(handle, Handoff::SHM, fds, 3)) {
+		perror("shm setup");
+		delete shm;
+		::close(handle);
+		return;
+	}
+	Connection* connection = accept_connection(handle, "unix");
+	if (connection == nullptr) {
+		delete shm;
+		return;
+	}
+	connection->shm = shm;
+	/* the handle only reports hang up, it's never read */
+	epoll_add_socket(handle, EPOLLRDHUP | EPOLLET);
+	struct epoll_event ev;
+	ev.data.u64 = connections.key(handle);
+	ev.events = EPOLLIN | EPOLLET;
+	::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shm->server_efd, &ev);
+	/* requests written before the registration are not signaled again */
+	read_shm(connection);
+}
+
+/* release remain free all remain handle and request before server exit */
+void Reactor::release_remain() {
+	Connection* list = notified_list.exchange(nullptr);
+	while (list != nullptr) {
+		Connection* connection = list;
+		list = list->next_notified;
+		connection->release();
+	}
+	connections.for_each([this](int handle, Connection* connection) {
+		/* close handle and release requests */
+		this->timers.remove(&connection->timer);
+		::close(handle);
+		connection->close();
+		connection->release();
+	});
+	connections.clear();
+	ReactorTask* task = posted_list.exchange(nullptr);
+	while (task != nullptr) {
+		ReactorTask* next = task->next_posted;
+		delete task;
+		task = next;
+	}
+	std::for_each(task_heap.begin(), task_heap.end(), [](ReactorTask* t) {
+		delete t;
+	});
+	task_heap.clear();
+	std::for_each(watches.begin(), watches.end(), [](ReactorTask* t) {
+		delete t;
+	});
+	watches.clear();
+}
+
+/*
+ * called from net thread, must receive data until EAGAIN or ERROR
+ * because we use ET mode, return false if the handle has been closed
+*/
+bool Reactor::read_connection(Connection* connection) {
+	int handle = connection->handle;
+	struct iovec iov[2];
+	while (!connection->paused) {
+		/* the rest of a large body is read into request directly,
+			the data after it goes to buffer 
+		*/
+		Request* request = connection->reading;
+		size_t direct = request->direct_read_size();
+		ssize_t num_read;
+		if (direct > 0) {
+			iov[0].iov_base = request->data + request->body_has_read;
+			iov[0].iov_len = direct;
+			iov[1].iov_base = buffer;
+			iov[1].iov_len = BUFFERSIZE;
+			num_read = readv(handle, iov, 2);
+		} else
+			num_read = read(handle, buffer, BUFFERSIZE);
+		if (num_read < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return true;
+			}
+			/* maybe errno == ECONNREST ... */
+			perror("read<0");
+			drop_connection(handle, true);
+			return false;
+		} else if (num_read == 0) {
+			drop_connection(handle, false);
+			return false;
+		}
+		metrics.bytes_in.add(num_read);
+		connection->read_ms = loop_ms;
+		if (server->config & Server::STAGE_METRICS)
+			read_ns = clock_ns();
+		if (direct > 0) {
+			size_t body_read = min((size_t)num_read, direct);
+			request->body_has_read += body_read;
+			num_read -= body_read;
+			if (request->is_full())
+				move_premature_request(connection);
+		}
+		/* have valid data, fill the unmature requests */
+		if (!parse_frames(connection, buffer, num_read))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * called from net thread, split src into frames of the connection,
+ * every full request is moved to pending queue, the rest is kept 
+ * in the reading request
+*/
+bool Reactor::parse_frames(Connection* connection, const char* src, int size) {
+	while (size > 0) {
+		Request* request = connection->reading;
+		if (request->header_has_read == 0) {
+			request->read_begin_ns = read_ns;
+			connection->frame_ms = loop_ms;
+		}
+		int taken = request->append_data(src, size);
+		src += taken;
+		size -= taken;
+		if (request->streaming) {
+			taken = stream_body(connection, src, size);
+			if (taken < 0)
+				return false;
+			src += taken;
+			size -= taken;
+		}
+		if (request->is_full())
+			move_premature_request(connection);
+	}
+	return true;
+}
+
+/*
+ * called from net thread, the body of the reading request in src goes to
+ * onStream directly, only the length read is kept
+*/
+int Reactor::stream_body(Connection* connection, const char* src, int size) {
+	Request* request = connection->reading;
+	unsigned int remain = request->get_length() - request->body_has_read;
+	int n = remain < (unsigned int)size ? (int)remain : size;
+	if (n == 0)
+		return 0;
+	request->body_has_read += n;
+	if (!server->server_events.onStream(request, src, n, request->is_full())) {
+		drop_connection(connection->handle, true);
+		return -1;
+	}
+	return n;
+}
+
+/*
+ * called from net thread, gather the header and body of the responses
+ * on the wire, then the matured ones, until the budget is reached
+*/
+int Reactor::gather_responses(Connection* connection, struct iovec* iov, int iov_limit) {
+	std::deque<Request*>& sending = connection->sending;
+	int count = 0;
+	size_t bytes = 0;
+	size_t picked = 0;
+	while (count + 2 <= iov_limit && bytes < server->write_bytes) {
+		Request* request;
+		if (picked < sending.size())
+			request = sending[picked];
+		else if ((request = connection->move_sending_request()) == nullptr)
+			break;
+		picked++;
+		int n = request->response->prepare_iovec(iov + count);
+		if (n < 0)
+			return -1;
+		for (int k = 0; k < n; k++)
+			bytes += iov[count + k].iov_len;
+		count += n;
+		/* the responses after it wait until its body is on the wire */
+		if (request->response->is_body_pending())
+			break;
+	}
+	return count;
+}
+
+void Reactor::consume_responses(Connection* connection, size_t size) {
+	std::deque<Request*>& sending = connection->sending;
+	uint64_t now = 0;
+	metrics.bytes_out.add(size);
+	connection->write_ms = loop_ms;
+	/* release the responses written completely, keep the partial one */
+	while (!sending.empty()) {
+		Request* request = sending.front();
+		size -= request->response->consume(size);
+		if (!request->response->is_written())
+			break;
+		sending.pop_front();
+		wait_send--;
+		metrics.frames_out.add();
+		finish_request(connection, request);
+		if (request->ended_ns != 0) {
+			if (now == 0)
+				now = clock_ns();
+			record_stages(request, now);
+		}
+		delete request;
+	}
+}
+
+/*
+ * called from net thread, the request has gone through all stages,
+ * requests timed partly, while STAGE_METRICS was turned on, are skipped
+*/
+void Reactor::record_stages(Request* request, uint64_t now) {
+	if (request->read_begin_ns == 0 || request->read_end_ns == 0 || request->picked_ns == 0)
+		return;
+	AtomicHistogram* stages = metrics.stages;
+	stages[STAGE_READ].record(request->read_end_ns - request->read_begin_ns);
+	stages[STAGE_QUEUE].record(request->picked_ns - request->read_end_ns);
+	stages[STAGE_HANDLE].record(request->ended_ns - request->picked_ns);
+	stages[STAGE_WRITE].record(now - request->ended_ns);
+	stages[STAGE_TOTAL].record(now - request->read_end_ns);
+}
+
+/*
+ * called from net thread, gather all matured responses of the connection 
+ * into one writev, within the write budget,
+ * must write out until EAGAIN or ERROR because we use ET mode, 
+ * return false if the handle has been closed
+*/
+bool Reactor::write_connection(Connection* connection) {
+	if (connection->shm != nullptr)
+		return write_shm(connection);
+	int handle = connection->handle;
+	struct iovec* iov = iovecs.data();
+	int iov_limit = (int)iovecs.size();
+	connection->write_pending = false;
+
+	while (true) {
+		if (!connection->sending.empty() && 
+				connection->sending.front()->response->is_sending_file()) {
+			if (!send_file(connection))
+				return false;
+			if (!connection->sending.empty() && 
+					connection->sending.front()->response->is_sending_file())
+				return true;
+			continue;
+		}
+		int count = gather_responses(connection, iov, iov_limit);
+		if (count == 0)
+			return true;
+		if (count < 0) {
+			drop_connection(handle, true);
+			return false;
+		}
+
+		ssize_t write_num = writev(handle, iov, count);
+		if (write_num < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			/* network fail, maybe peer abort, like as EPIPE */
+			perror("write<0");
+			drop_connection(handle, true);
+			return false;
+		}
+		consume_responses(connection, write_num);
+	}
+}
+
+/*
+ * called from net thread, sendfile the body of the first response on the 
+ * wire until it's done or EAGAIN, return false if the handle has been closed
+*/
+bool Reactor::send_file(Connection* connection) {
+	int handle = connection->handle;
+	Response* response = connection->sending.front()->response;
+	while (response->is_sending_file()) {
+		off_t offset = response->file_offset + response->body_has_written;
+		ssize_t write_num = sendfile(handle, response->file_fd, &offset,
+				response->get_length() - response->body_has_written);
+		if (write_num < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			perror("sendfile<0");
+			drop_connection(handle, true);
+			return false;
+		} else if (write_num == 0) {
+			/* the file is shorter than the length sent in header */
+			fprintf(stderr, "sendfile: unexpected end of file\n");
+			drop_connection(handle, true);
+			return false;
+		}
+		/* the response is deleted once written completely */
+		bool done = write_num == response->get_length() - response->body_has_written;
+		consume_responses(connection, write_num);
+		if (done)
+			break;
+	}
+	return true;
+}
+
+/*
+ * called from net thread, parse the requests in the ring of a shared memory
+ * connection until it's empty, then the client is asked to signal for more.
+ * the client also signals when it has freed space for the responses waiting,
+ * they are written after. return false if the handle has been closed
+*/
+bool Reactor::read_shm(Connection* connection) {
+	ShmSegment* shm = connection->shm;
+	ShmPipe& requests = shm->requests;
+	uint64_t value;
+	while (read(shm->server_efd, &value, sizeof(value)) > 0)
+		;
+	while (!connection->paused) {
+		const char* src;
+		size_t size = requests.peek(src);
+		if (size == 0) {
+			if (requests.is_broken()) {
+				fprintf(stderr, "shm: bad request ring\n");
+				drop_connection(connection->handle, true);
+				return false;
+			}
+			if (requests.sleep_reader())
+				break;
+			continue;
+		}
+		size = std::min(size, (size_t)BUFFERSIZE);
+		metrics.bytes_in.add(size);
+		connection->read_ms = loop_ms;
+		if (server->config & Server::STAGE_METRICS)
+			read_ns = clock_ns();
+		if (!parse_frames(connection, src, (int)size))
+			return false;
+		requests.consume(size);
+		if (requests.wake_writer())
+			ShmSegment::signal(shm->client_efd);
+	}
+	if (connection->write_pending || !connection->sending.empty())
+		return write_shm(connection);
+	return true;
+}
+
+/*
+ * called from net thread, copy the responses into the ring, when it's full
+ * the client signals once it has read some, return false if the handle has
+ * been closed
+*/
+bool Reactor::write_shm(Connection* connection) {
+	ShmSegment* shm = connection->shm;
+	ShmPipe& responses = shm->responses;
+	struct iovec* iov = iovecs.data();
+	int iov_limit = (int)iovecs.size();
+	bool written = false;
+	connection->write_pending = false;
+
+	while (true) {
+		int count = gather_responses(connection, iov, iov_limit);
+		if (count == 0)
+			break;
+		if (count < 0) {
+			drop_connection(connection->handle, true);
+			return false;
+		}
+		size_t write_num = responses.writev(iov, count);
+		if (write_num == 0) {
+			if (responses.is_broken()) {
+				fprintf(stderr, "shm: bad response ring\n");
+				drop_connection(connection->handle, true);
+				return false;
+			}
+			if (responses.sleep_writer())
+				break;
+			continue;
+		}
+		written = true;
+		consume_responses(connection, write_num);
+	}
+	if (written && responses.wake_reader())
+		ShmSegment::signal(shm->client_efd);
+	return true;
+}
+
+/*
+ * the event loop of one reactor, accepts on its own listen socket, 
+ * reads requests and writes responses of the handles it accepted
+*/
+void Reactor::run() {
+#ifdef NEUSC_HAVE_URING
+	if (uring != nullptr) {
+		run_uring();
+		return;
+	}
+#endif
+
+	while (!Server::exit_flag) {
+		int nfds = epoll_wait(epoll_fd, events, EVENTSIZE, wait_timeout());
+		loop_ms = clock_ns() / 1000000;
+
+		for (int i = 0; i < nfds; i++) {
+			uint64_t key = events[i].data.u64;
+			if (!ConnectionTable::is_connection(key)) {
+				if ((int)key == listen_fd)
+					accept_epoll();
+				else if ((int)key == wake_fd) {
+					uint64_t value;
+					while (read(wake_fd, &value, sizeof(value)) > 0)
+						;
+					/* flushed below */
+				} else
+					finish_watch((int)key, events[i].events);
+				continue;
+			}
+			/* nullptr if the handle was closed earlier in this batch */
+			Connection *connection = connections.find(key);
+			if (connection == nullptr)
+				continue;
+			/* the eventfd of a shared memory connection carries its key too */
+			if (connection->shm != nullptr) {
+				if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+					drop_connection(connection->handle, false);
+				else
+					read_shm(connection);
+				continue;
+			}
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				/* encounter error */
+				int handle = connection->handle;
+				close_connection(handle);
+				epoll_delete_socket(handle);
+				clear_handle(handle);
+				continue;
+			}
+			/* request data incoming */
+			if ((events[i].events & EPOLLIN) && !read_connection(connection))
+				continue;
+			/* active sending out responses, all matured responses of the 
+				connection are gathered into writev until EAGAIN or ERROR.
+				responses matured later are sent by flush_notified when
+				work threads wake the reactor up
+			*/
+			if ((events[i].events & EPOLLOUT) || connection->write_pending)
+				write_connection(connection);
+		}
+		/* the list may be filled without a wake up, while it's not empty */
+		flush_notified();
+		run_posted();
+		check_paused();
+		run_timers();
+		if (server->handing_off)
+			run_handoff();
+	}
+}
+
+/*
+ * called from net thread, drain the backlog of the listen socket, at most
+ * ACCEPT_BATCH connections at a time, accept4 makes them non-blocking
+*/
+void Reactor::accept_epoll() {
+	for (int i = 0; i < ACCEPT_BATCH; i++) {
+		struct sockaddr_in client_address;
+		socklen_t clilen = sizeof(client_address);
+		int connect_fd = accept4(listen_fd, (struct sockaddr*)&client_address,
+				&clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (connect_fd < 0) {
+			/* the peer has gone before it's accepted */
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("connect_fd");
+			return;
+		}
+		const char* client_ip = inet_ntoa(client_address.sin_addr);
+		if (accept_connection(connect_fd, client_ip) != nullptr)
+			epoll_add_socket(connect_fd, EPOLLIN | EPOLLOUT | EPOLLET);
+	}
+}
+
+#ifdef NEUSC_HAVE_URING
+
+/*
+ * set up the ring, the provided buffers and the wake eventfd,
+ * return false to fall back to epoll
+*/
+bool Reactor::open_uring() {
+	uring = new Uring();
+	assert(uring);
+	if (!uring->init(URING_ENTRIES) ||
+			!uring->setup_buffers(URING_BUFFER_COUNT, URING_BUFFER_SIZE)) {
+		delete uring;
+		uring = nullptr;
+		return false;
+	}
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wake_fd < 0) {
+		perror("eventfd");
+		delete uring;
+		uring = nullptr;
+		return false;
+	}
+	use_sendfile = false;
+	return true;
+}
+
+/*
+ * the io_uring event loop, accept and recv are multishot, so one sqe keeps
+ * producing completions, recv data is in the provided buffers and framed 
+ * in place. responses go out by one writev sqe per connection at a time
+*/
+void Reactor::run_uring() {
+	uring_accept();
+	uring_wake();
+
+	while (!Server::exit_flag) {
+		/* the backlog is handled without waiting, a refused sqe is tried
+			again soon
+		*/
+		int timeout = wait_timeout();
+		if (!uring_backlog.empty())
+			timeout = 0;
+		else if (!uring_retry.empty())
+			timeout = std::min(timeout, 1);
+		int ret = uring->submit(1, timeout);
+		loop_ms = clock_ns() / 1000000;
+		if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY) {
+			errno = -ret;
+			perror("io_uring_enter");
+			break;
+		}
+		/* completions moved aside are older than those left in the ring */
+		if (!uring_backlog.empty()) {
+			std::vector<struct io_uring_cqe> backlog;
+			backlog.swap(uring_backlog);
+			for (size_t i = 0; i < backlog.size(); i++)
+				handle_cqe(backlog[i].user_data, backlog[i].res, backlog[i].flags);
+		}
+		struct io_uring_cqe* cqe;
+		while ((cqe = uring->peek_cqe()) != nullptr) {
+			uint64_t user_data = cqe->user_data;
+			int res = cqe->res;
+			unsigned flags = cqe->flags;
+			uring->cqe_seen();
+			handle_cqe(user_data, res, flags);
+		}
+		if (!uring_retry.empty())
+			retry_uring();
+		/* the list may be filled without a wake up, while it's not empty */
+		flush_notified();
+		run_posted();
+		check_paused();
+		run_timers();
+		if (server->handing_off)
+			run_handoff();
+	}
+	drain_uring();
+}
+
+void Reactor::handle_cqe(uint64_t user_data, int res, unsigned flags) {
+	Connection* connection = reinterpret_cast<Connection*>(
+			(uintptr_t)(user_data & ~(uint64_t)URING_TAG_MASK));
+	switch (user_data & URING_TAG_MASK) {
+	case URING_RECV:
+		handle_recv(connection, res, flags);
+		break;
+	case URING_SEND:
+		handle_send(connection, res);
+		break;
+	case URING_ACCEPT:
+		handle_accept(res, flags);
+		break;
+	case URING_WAKE:
+		uring_wake();
+		break;
+	case URING_POLL:
+		finish_watch(reinterpret_cast<ReactorTask*>(connection)->fd,
+				res < 0 ? EPOLLERR : res);
+		break;
+	}
+}
+
+/*
+ * submit again what the ring refused in the last loop, what's still
+ * refused is queued for the next one
+*/
+void Reactor::retry_uring() {
+	std::vector<uint64_t> retry;
+	retry.swap(uring_retry);
+	for (size_t i = 0; i < retry.size(); i++) {
+		Connection* connection = reinterpret_cast<Connection*>(
+				(uintptr_t)(retry[i] & ~(uint64_t)URING_TAG_MASK));
+		switch (retry[i] & URING_TAG_MASK) {
+		case URING_RECV:
+			if (!connection->is_closed() && !connection->recv_armed &&
+					!connection->paused && !connection->leaving)
+				uring_recv(connection);
+			connection->release();
+			break;
+		case URING_SEND:
+			if (!connection->is_closed())
+				uring_send(connection);
+			connection->release();
+			break;
+		case URING_ACCEPT:
+			if (accepting)
+				uring_accept();
+			break;
+		case URING_WAKE:
+			uring_wake();
+			break;
+		case URING_CANCEL:
+			uring_cancel_accept();
+			break;
+		case URING_POLL:
+			cancel_watch((int)(retry[i] >> 3));
+			break;
+		}
+	}
+}
+
+/*
+ * called when the loop exits, shutdown all handles so the recv and writev 
+ * in flight end, and drop the connection references they hold
+*/
+void Reactor::drain_uring() {
+	for (size_t i = 0; i < uring_retry.size(); i++) {
+		uint64_t tag = uring_retry[i] & URING_TAG_MASK;
+		if (tag == URING_RECV || tag == URING_SEND)
+			reinterpret_cast<Connection*>(
+				(uintptr_t)(uring_retry[i] & ~(uint64_t)URING_TAG_MASK))->release();
+	}
+	uring_retry.clear();
+	connections.for_each([](int handle, Connection* connection) {
+		::shutdown(handle, SHUT_RDWR);
+	});
+	for (int i = 0; i < 10 && (uring_inflight > 0 || !uring_backlog.empty()); i++) {
+		std::vector<struct io_uring_cqe> drained;
+		drained.swap(uring_backlog);
+		uring->submit(1, drained.empty() ? 100 : 0);
+		struct io_uring_cqe* cqe;
+		while ((cqe = uring->peek_cqe()) != nullptr) {
+			drained.push_back(*cqe);
+			uring->cqe_seen();
+		}
+		for (size_t k = 0; k < drained.size(); k++) {
+			uint64_t user_data = drained[k].user_data;
+			int res = drained[k].res;
+			unsigned flags = drained[k].flags;
+			Connection* connection = reinterpret_cast<Connection*>(
+					(uintptr_t)(user_data & ~(uint64_t)URING_TAG_MASK));
+			switch (user_data & URING_TAG_MASK) {
+			case URING_RECV:
+				if (res > 0)
+					uring->recycle_buffer(flags >> IORING_CQE_BUFFER_SHIFT);
+				if (flags & IORING_CQE_F_MORE)
+					break;
+				uring_inflight--;
+				connection->release();
+				break;
+			case URING_SEND:
+				connection->send_inflight = false;
+				if (connection->is_closed())
+					connection->release_sending();
+				uring_inflight--;
+				connection->release();
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * the kernel refuses to submit while completions overflow the ring
+ * (-EBUSY), they are moved to the backlog, which the loop handles first,
+ * then the sqe is tried again
+*/
+struct io_uring_sqe* Reactor::uring_sqe() {
+	struct io_uring_sqe* sqe = uring->get_sqe();
+	if (sqe != nullptr)
+		return sqe;
+	struct io_uring_cqe* cqe;
+	while ((cqe = uring->peek_cqe()) != nullptr) {
+		uring_backlog.push_back(*cqe);
+		uring->cqe_seen();
+	}
+	sqe = uring->get_sqe();
+	if (sqe == nullptr)
+		fprintf(stderr, "io_uring: submission queue is full\n");
+	return sqe;
+}
+
+void Reactor::uring_accept() {
+	struct io_uring_sqe* sqe = uring_sqe();
+	if (sqe == nullptr) {
+		uring_retry.push_back(URING_ACCEPT);
+		return;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_fd;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = URING_ACCEPT;
+}
+
+void Reactor::uring_cancel_accept() {
+	struct io_uring_sqe* sqe = uring_sqe();
+	if (sqe == nullptr) {
+		uring_retry.push_back(URING_CANCEL);
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = URING_ACCEPT;
+	sqe->user_data = URING_CANCEL;
+}
+
+void Reactor::uring_wake() {
+	struct io_uring_sqe* sqe = uring_sqe();
+	if (sqe == nullptr) {
+		uring_retry.push_back(URING_WAKE);
+		return;
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = wake_fd;
+	sqe->addr = (uint64_t)(uintptr_t)&wake_value;
+	sqe->len = sizeof(wake_value);
+	sqe->user_data = URING_WAKE;
+}
+
+/*
+ * arm recv of the connection, the kernel picks a provided buffer for
+ * every completion, the sqe holds a reference until its last completion
+*/
+void Reactor::uring_recv(Connection* connection) {
+	struct io_uring_sqe* sqe = uring_sqe();
+	if (sqe == nullptr) {
+		connection->acquire();
+		uring_retry.push_back((uint64_t)(uintptr_t)connection | URING_RECV);
+		return;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = connection->handle;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = Uring::BUFFER_GROUP;
+	if (recv_multishot)
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = (uint64_t)(uintptr_t)connection | URING_RECV;
+	connection->recv_armed = true;
+	connection->acquire();
+	uring_inflight++;
+}
+
+/* the recv ends with -ECANCELED, and is not re-armed while paused */
+bool Reactor::uring_cancel_recv(Connection* connection) {
+	struct io_uring_sqe* sqe = uring_sqe();
+	if (sqe == nullptr)
+		return false;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t)(uintptr_t)connection | URING_RECV;
+	sqe->user_data = URING_CANCEL;
+	return true;
+}
+
+/*
+ * gather the responses into one writev sqe if none of the connection is 
+ * in flight, the rest is sent when it completes
+*/
+void Reactor::uring_send(Connection* connection) {
+	connection->write_pending = false;
+	if (connection->send_inflight)
+		return;
+	std::vector<struct iovec>& iov = connection->send_iovecs;
+	if (iov.empty())
+		iov.resize(server->write_iov_count);
+	int count = gather_responses(connection, iov.data(), (int)iov.size());
+	if (count == 0)
+		return;
+	if (count < 0) {
+		drop_connection(connection->handle, true);
+		return;
+	}
+	/* gathered again from the same responses when it's retried */
+	struct io_uring_sqe* sqe = uring_sqe();
+	if (sqe == nullptr) {
+		connection->write_pending = true;
+		connection->acquire();
+		uring_retry.push_back((uint64_t)(uintptr_t)connection | URING_SEND);
+		return;
+	}
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = connection->handle;
+	sqe->addr = (uint64_t)(uintptr_t)iov.data();
+	sqe->len = count;
+	sqe->user_data = (uint64_t)(uintptr_t)connection | URING_SEND;
+	connection->send_inflight = true;
+	connection->acquire();
+	uring_inflight++;
+}
+
+void Reactor::handle_accept(int res, unsigned flags) {
+	if (res >= 0) {
+		struct sockaddr_in client_address;
+		socklen_t clilen = sizeof(client_address);
+		memset(&client_address, 0, sizeof(client_address));
+		getpeername(res, (struct sockaddr*)&client_address, &clilen);
+		const char* client_ip = inet_ntoa(client_address.sin_addr);
+		Connection* connection = accept_connection(res, client_ip);
+		if (connection != nullptr)
+			uring_recv(connection);
+	} else if (res != -ECANCELED || accepting) {
+		errno = -res;
+		perror("connect_fd");
+	}
+	if (!(flags & IORING_CQE_F_MORE) && accepting)
+		uring_accept();
+}
+
+/*
+ * multishot recv keeps going while IORING_CQE_F_MORE is set, re-armed
+ * when it stops for lack of buffers, falls back to single shot if kernel
+ * doesn't support multishot
+*/
+void Reactor::handle_recv(Connection* connection, int res, unsigned flags) {
+	bool more = flags & IORING_CQE_F_MORE;
+	if (res > 0) {
+		unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		metrics.bytes_in.add(res);
+		connection->read_ms = loop_ms;
+		if (server->config & Server::STAGE_METRICS)
+			read_ns = clock_ns();
+		if (!connection->is_closed() && 
+				parse_frames(connection, uring->get_buffer(bid), res) &&
+				connection->write_pending)
+			uring_send(connection);
+		uring->recycle_buffer(bid);
+	}
+	if (!more) {
+		uring_inflight--;
+		connection->recv_armed = false;
+	}
+	if (!connection->is_closed()) {
+		int handle = connection->handle;
+		if (res == 0) {
+			drop_connection(handle, false);
+		} else if (res == -EINVAL && recv_multishot) {
+			recv_multishot = false;
+			uring_recv(connection);
+		} else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+			errno = -res;
+			perror("read<0");
+			drop_connection(handle, true);
+		} else if (!more && !connection->paused) {
+			/* a leaving connection is handed over once idle, unless the
+				last recv has cut a frame
+			*/
+			if (connection->leaving && connection->reading->header_has_read > 0)
+				connection->leaving = false;
+			if (!connection->leaving)
+				uring_recv(connection);
+		}
+	}
+	if (!more)
+		connection->release();
+}
+
+void Reactor::handle_send(Connection* connection, int res) {
+	connection->send_inflight = false;
+	uring_inflight--;
+	if (connection->is_closed()) {
+		connection->release_sending();
+	} else if (res < 0) {
+		/* network fail, maybe peer abort, like as EPIPE */
+		errno = -res;
+		perror("write<0");
+		drop_connection(connection->handle, true);
+	} else {
+		consume_responses(connection, res);
+		uring_send(connection);
+	}
+	connection->release();
+}
+
+#endif // NEUSC_HAVE_URING
@@ -14,6 +14,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -23,13 +24,24 @@
 #include <unordered_map>
 #include <deque>
 #include <cerrno>
+#include <climits>
 #include <pthread.h>
 #include <sys/time.h>
 #include <algorithm>
+#include <atomic>
+#include "neusc_pool.h"
+#include "neusc_uring.h"
+#include "neusc_scheduler.h"
+#include "neusc_timer.h"
+#include "neusc_metrics.h"
+#include "neusc_handoff.h"
+#include "neusc_shm.h"
 
 namespace neusc {
 
 class Server;
+class Reactor;
+class Connection;
 class Request;
 class Response;
 
@@ -48,66 +60,246 @@ struct ServerEvents {
 	*/
 	std::function<bool(Request*)> onRequest = nullptr;
 
+	/* onRequestBatch is called instead of onRequest if onRequest is not set,
+	 * with at most Server::set_request_batch requests picked at once. every
+	 * request must be ended by end_response or discard_response
+	*/
+	std::function<void(Request**, size_t)> onRequestBatch = nullptr;
+
+	/* onExpired is called instead of onRequest for a request picked after
+	 * its deadline, see Server::set_request_timeout. it may respond, e.g.
+	 * with an error, or return false for no response. if it's not set,
+	 * the expired request is discarded
+	*/
+	std::function<bool(Request*)> onExpired = nullptr;
+
+	/* onStream receives the body of a large request chunk by chunk as it is
+	 * read, in net thread, instead of buffering it. it's used for bodies of
+	 * Server::set_stream_threshold bytes or more. data is only valid in the
+	 * call, last is true for the final chunk. the request then goes to
+	 * onRequest as usual with no body, see Request::is_streamed.
+	 * if the connection closes in the middle, it's called once more with data
+	 * nullptr and last true, so the state of the stream can be released.
+	 * return false to reset the connection.
+	*/
+	std::function<bool(Request*, const char*, size_t, bool)> onStream = nullptr;
+
+	/* onClassify is called in net thread when a request is framed, before it
+	 * is pending, to set its priority or deadline for the Scheduler
+	*/
+	std::function<void(Request*)> onClassify = nullptr;
+
 	/* onPick gives a pending_list for choosing a request for work thread to process,
 	 * the list must not lock again because it has locked. the function needs to
-	 * return the select request's iterator. you can delete the item which you don't
-	 * want to process, but you should be careful that will make a result of 
-	 * no response to client.
+	 * return the select request's iterator, or end() to wait for the next request.
+	 * you can delete the item which you don't want to process, but you should be 
+	 * careful that will make a result of no response to client.
+	 * the scan is O(n) under the lock, Server::set_scheduler is preferred.
 	 * If onPick set to nullptr, default process will select the first item to continue
 	*/
-	std::function<std::list<Request*>::iterator(std::list<Request*>)> onPick = nullptr;
+	std::function<std::list<Request*>::iterator(std::list<Request*>&)> onPick = nullptr;
+};
+
+/* socket options of the listen sockets, set once on every listener before
+ * listen, the sockets accepted from it inherit them. 0 or false leaves 
+ * the kernel default, see Server::set_socket_options
+*/
+struct SocketOptions {
+	/* backlog of listen, the kernel caps it by net.core.somaxconn */
+	int backlog = 1024;
+	bool tcp_nodelay = false;
+	/* SO_RCVBUF and SO_SNDBUF in bytes, they turn off autotuning */
+	int rcvbuf = 0;
+	int sndbuf = 0;
+	/* a connection is accepted only when its first data has come, 
+	 * or after the seconds. TCP_DEFER_ACCEPT
+	*/
+	int defer_accept_s = 0;
+	/* microseconds a read busy polls the device queue, SO_BUSY_POLL,
+	 * more than net.core.busy_read needs CAP_NET_ADMIN
+	*/
+	int busy_poll_us = 0;
+	/* keepalive probes after idle seconds, every interval seconds, the
+	 * connection is reset after count probes fail. off if idle is 0
+	*/
+	int keepalive_idle_s = 0;
+	int keepalive_interval_s = 0;
+	int keepalive_count = 0;
 };
 
 class Response {
 	friend class Server;
+	friend class Reactor;
+	friend class Connection;
 	friend class Request;
 public:
 	Response(Request *request);
 	~Response();
+
+	/* responses are recycled by Pool */
+	static void* operator new(size_t size) { return Pool::alloc(size); }
+	static void operator delete(void* p, size_t size) { Pool::free(p, size); }
+
+	/* Producer fills buf with at most size bytes of the body, returns the 
+	 * bytes filled, 0 or less fails the response and resets the connection
+	*/
+	typedef std::function<ssize_t(char* buf, size_t size)> Producer;
+	/* body of a streamed response is produced in chunks of this size */
+	static const size_t CHUNK_SIZE = 64 * 1024;
+
 	const char * get_ptr() { return data; }
-	int get_size() { return get_length(); }
+	unsigned int get_size() { return get_length(); }
 protected:
-	inline int get_length() const {
-		return length_buf[0] << 24 |
-			length_buf[1] << 16 | length_buf[2] << 8 | length_buf[3];
+	inline unsigned int get_length() const {
+		return (unsigned int)header_buf[0] << 24 |
+			header_buf[1] << 16 | header_buf[2] << 8 | header_buf[3];
 	}
 	inline void set_length(unsigned int len) {
-		length_buf[0] = len >> 24;
-		length_buf[1] = (len & 0x00FFFFFFU) >> 16;
-		length_buf[2] = (len & 0x00FFFFU) >> 8;
-		length_buf[3] = len & 0x00FFU;
+		header_buf[0] = len >> 24;
+		header_buf[1] = (len & 0x00FFFFFFU) >> 16;
+		header_buf[2] = (len & 0x00FFFFU) >> 8;
+		header_buf[3] = len & 0x00FFU;
 	}
-	void write_data(int handle, Server* server);
+	/* fill iov with the unwritten header and body, return count of iovec,
+	 *	-1 if the producer fails
+	*/
+	int prepare_iovec(struct iovec* iov);
+	/* part of the body is not in the iovecs, chunks to produce or a file
+	 *	range to sendfile, the responses after it wait
+	*/
+	bool is_body_pending() const {
+		return (producer && produced < get_length()) || 
+			(file_fd >= 0 && map == nullptr && body_has_written < get_length());
+	}
+	/* header is written, the rest goes by sendfile */
+	bool is_sending_file() const {
+		return file_fd >= 0 && map == nullptr && header_has_written == header_size &&
+			body_has_written < get_length();
+	}
+	/* mark size bytes written, return bytes taken by this response */
+	size_t consume(size_t size);
+	bool is_written() const {
+		return header_has_written == header_size && body_has_written == get_length();
+	}
+	void release_data();
 	Request *request;
 	char* data;
-	int body_has_written;
-	int length_has_written;
-	unsigned char length_buf[4];
+	/* capacity of data from Pool, 0 if data is refered from caller */
+	size_t data_capacity;
+	/* streamed body, the chunk is produced on the net thread when the
+	 *	previous one has been written
+	*/
+	Producer producer;
+	char* chunk;
+	size_t chunk_capacity;
+	size_t chunk_size;
+	size_t chunk_written;
+	unsigned int produced;
+	/* file body, sent by sendfile from file_offset, or writev from the
+	 *	mapping of the range on io_uring
+	*/
+	int file_fd;
+	bool file_owned;
+	off_t file_offset;
+	char* map;
+	size_t map_size;
+	unsigned int body_has_written;
+	int header_has_written;
+	/* 4 bytes length, followed by 4 bytes request id echoed on REQUEST_ID */
+	int header_size;
+	unsigned char header_buf[8];
 };
 
 class Request {
 	friend class Server;
+	friend class Reactor;
+	friend class Connection;
 	friend class Response;
 public:
 	static const int RESERVED_SIZE = 1024;
-	Request(Server* server, int handle);
+	/* body remains at least this size is read without copying */
+	static const int DIRECT_READ_SIZE = 16 * 1024;
+	Request(Connection* connection);
 	~Request();
 
+	/* requests are recycled by Pool */
+	static void* operator new(size_t size) { return Pool::alloc(size); }
+	static void operator delete(void* p, size_t size) { Pool::free(p, size); }
+
 	/* request buffer start ptr and size */
 	const char* get_ptr() { return data; }
-	int get_size() { return get_length(); }
+	unsigned int get_size() { return get_length(); }
+	/* the body has gone to onStream, get_ptr is nullptr */
+	bool is_streamed() const { return streaming; }
+
+	/* lower priority runs first with PriorityScheduler */
+	void set_priority(int p) { priority = p; }
+	int get_priority() const { return priority; }
+	/* CLOCK_MONOTONIC ns, see clock_ns(), 0 is no deadline, for DeadlineScheduler */
+	void set_deadline(uint64_t ns) { deadline = ns; }
+	uint64_t get_deadline() const { return deadline; }
+
+	/* handle the request in the reactor thread, defaults to INLINE_REQUEST, 
+	 *	can be changed in onClassify
+	*/
+	void set_inline(bool i) { run_inline = i; }
+	bool is_inline() const { return run_inline; }
+
+	/* user state of the request, e.g. the file a stream is written to */
+	void set_context(void* c) { context = c; }
+	void* get_context() const { return context; }
+
+	/* request id sent by client, only valid if server sets REQUEST_ID */
+	unsigned int get_id() const {
+		return header_buf[4] << 24 |
+			header_buf[5] << 16 | header_buf[6] << 8 | header_buf[7];
+	}
 
 	/* copy data to reponse buffer */
-	void clone_response(int size, const char* buf);
+	void clone_response(size_t size, const char* buf);
 
 	/* NOTE: refer data can eliminate copy of data, 
 	 *	but will be released by response as delete[] data 
-    */
-	void refer_response(int size, const char* buf);
+	*/
+	void refer_response(size_t size, const char* buf);
+
+	/* response of length bytes, produced in chunks by producer in net thread
+	 *	while it's written, so the body is never held in memory all at once.
+	 *	the producer is destroyed with the response, it can own its source
+	*/
+	void stream_response(size_t length, Response::Producer producer);
+
+	/* response of length bytes of file fd from offset, the body is sent by
+	 *	sendfile, or written from a mapping of the range with IO_URING, it's 
+	 *	never copied into user space. fd must stay open until the response
+	 *	is written, or be owned by the response and closed then.
+	 *	return false if the range can't be mapped
+	*/
+	bool file_response(int fd, off_t offset, size_t length, bool own_fd = false);
 
 	/* set response mature for reply out */
 	void end_response();
 
+	/* no response to the request, like onRequest returns false */
+	void discard_response();
+
+	/* run fn in the net thread of the connection after delay_ms, from any
+	 *	thread, e.g. to go on with the request without holding a work thread.
+	 *	fn runs even if the request has ended or the connection has closed,
+	 *	tasks still waiting when the server exits are dropped without running
+	*/
+	void post(std::function<void()> fn, unsigned int delay_ms = 0);
+	/* run fn once in the net thread when fd is ready for events (EPOLLIN,
+	 *	EPOLLOUT), with the ready events, or EPOLLERR if fd can't be watched.
+	 *	a reactor watches a fd for one fn at a time. fd must stay open until
+	 *	fn has run, a closed fd is never ready, so unwatch it before closing
+	*/
+	void watch(int fd, unsigned int events, std::function<void(unsigned int)> fn);
+	/* cancel the watch of fd, its fn runs with EPOLLERR. nothing happens
+	 *	if fn has run already
+	*/
+	void unwatch(int fd);
+
 	/* release request data, only can be used when have got 
 	 *	the request data in word queue 
 	*/
@@ -116,28 +308,68 @@ public:
 	/* get response ptr */
 	Response *res() { return response; }
 protected:
-	inline int get_length() const {
-		return length_buf[0] << 24 |
-			length_buf[1] << 16 | length_buf[2] << 8 | length_buf[3];
+	inline unsigned int get_length() const {
+		return (unsigned int)header_buf[0] << 24 |
+			header_buf[1] << 16 | header_buf[2] << 8 | header_buf[3];
 	}
 
-	bool reserve_size(int new_size);
-	void append_data(const char* src, int size, int handle, Server* server);
+	bool reserve_size(size_t new_size);
+	int append_data(const char* src, int size);
+	bool is_full() const {
+		return header_has_read == header_size && body_has_read == get_length();
+	}
+	/* size to read into data directly, 0 if the body is not large enough */
+	size_t direct_read_size() const {
+		if (header_has_read < header_size || streaming)
+			return 0;
+		size_t remain = get_length() - body_has_read;
+		return remain >= DIRECT_READ_SIZE ? remain : 0;
+	}
+
+	/* hand the request back to its connection, called once per request */
+	void complete();
 
 	Server *server;
+	/* the reactor owns the handle, response is sent back through it */
+	Reactor *reactor;
+	Connection *connection;
 	Response *response;
 	char* data;
 	int handle;
 
-	/* the request in mature_list, if matured & discard, 
-	 *	request will be deleted immediate 
+	/* order of the request on its connection, RESPONSE_ORDERLY sends by it */
+	unsigned long sequence;
+	/* link in the completed stack of the connection */
+	Request *next_completed;
+
+	/* matured request has been handed back to its connection,
+	 *	if matured & discard, request will be deleted without response
 	*/
-	volatile bool matured;
+	std::atomic<bool> matured;
 	bool discard;
-	int reserved_size;
-	int body_has_read;
-	int length_has_read;
-	unsigned char length_buf[4];
+	/* body goes to onStream, decided when the header is read */
+	bool streaming;
+	void* context;
+	int priority;
+	uint64_t deadline;
+	bool run_inline;
+	/* picked after deadline */
+	bool expired;
+
+	/* stage timestamps in ns, see Stage, set on STAGE_METRICS */
+	uint64_t read_begin_ns;
+	uint64_t read_end_ns;
+	uint64_t picked_ns;
+	uint64_t ended_ns;
+
+	/* header and body size, counted in flight until the response is written */
+	size_t frame_size;
+	size_t reserved_size;
+	unsigned int body_has_read;
+	int header_has_read;
+	/* 4 bytes length, followed by 4 bytes request id on REQUEST_ID */
+	int header_size;
+	unsigned char header_buf[8];
 };
 
 /* when a request has filled completely, it's moved to pending request list
@@ -151,68 +383,700 @@ struct PendingList {
 	void unlock() { mutex.unlock(); }
 };
 
-/* All requests which have end response will be move to this list
+/* PendingRing is a bounded multi-producer multi-consumer ring of requests,
+ * every cell carries a sequence number, so push and pop take only one CAS 
+ * and no node is allocated. it's the default pending queue, the PendingList
+ * is only used when onPick or a scheduler is set.
 */
-struct MatureList {
+class PendingRing {
+public:
+	PendingRing();
+	~PendingRing();
+	/* capacity is round up to power of 2 */
+	void init(size_t capacity);
+	/* return false if ring is full */
+	bool push(Request* request);
+	/* return nullptr if ring is empty */
+	Request* pop();
+	size_t size() const {
+		size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+		size_t head = dequeue_pos.load(std::memory_order_relaxed);
+		return tail > head ? tail - head : 0;
+	}
+protected:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		Request* request;
+	};
+	Cell* cells;
+	size_t mask;
+	/* keep producer and consumer position on different cache line */
+	char pad0[64];
+	std::atomic<size_t> enqueue_pos;
+	char pad1[64];
+	std::atomic<size_t> dequeue_pos;
+	char pad2[64];
+};
+
+/* WorkerQueue belongs to one work thread in WORKER_AFFINITY mode, requests of the handles
+ * hashed to it are pushed to its own ring, other idle workers steal from
+ * the ring when it backs up
+*/
+struct WorkerQueue {
+	PendingRing ring;
 	std::mutex mutex;
-	std::list<Request*> list;
-	void lock() { mutex.lock(); }
-	void unlock() { mutex.unlock(); }
+	std::condition_variable cond;
+	std::atomic<bool> parked;
+	/* set under mutex to wake the worker up for stealing */
+	bool wake;
+	WorkerQueue() : parked(false), wake(false) {}
+};
+
+/* Connection keeps all the requests of one handle in its reactor.
+ * work threads push matured requests to the lock free completed stack,
+ * the reactor collects them into ready queue, which is indexed by sequence 
+ * when RESPONSE_ORDERLY is set, so picking next response is O(1).
+ * the connection is released when the reactor and all requests drop it.
+*/
+class Connection {
+	friend class Server;
+	friend class Reactor;
+	friend class Request;
+	friend class Response;
+public:
+	Connection(Reactor* reactor, int handle);
+	int get_handle() const { return handle; }
+	bool is_closed() const { return completed.load() == CLOSED; }
+protected:
+	~Connection();
+	void acquire() { refs.fetch_add(1, std::memory_order_relaxed); }
+	void release() {
+		if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+
+	/* called from any thread, return true if the stack was empty */
+	bool push_completed(Request* request);
+
+	/* called from net thread */
+	void collect_completed();
+	/* move next response from ready queue to the tail of sending queue */
+	Request* move_sending_request();
+	void close();
+	/* delete the requests on the wire, their buffers are not used any more */
+	void release_sending();
+
+	/* completed stack is set to CLOSED when the handle is cleared */
+	static Request* const CLOSED;
+
+	Reactor *reactor;
+	int handle;
+	std::atomic<int> refs;
+	std::atomic<Request*> completed;
+
+	/* below are only touched by net thread */
+	Request *reading;
+	/* responses on the wire, written in this order by one writev */
+	std::deque<Request*> sending;
+	std::deque<Request*> ready;
+	unsigned long read_sequence;
+	unsigned long send_sequence;
+	/* responses were ended inline by the reactor, write them after the read */
+	bool write_pending;
+
+	/* checks the timeouts, with times of the last read, the first byte of
+	 *	the reading frame and the last write in ms
+	*/
+	Timer timer;
+	uint64_t read_ms;
+	uint64_t frame_ms;
+	uint64_t write_ms;
+
+	/* the connection is linked in the notified list of its reactor once
+	 *	until the reactor takes it. with io_uring it keeps at most one
+	 *	writev in flight with its own iovecs
+	*/
+	std::atomic<bool> notified;
+	Connection *next_notified;
+	bool send_inflight;
+	bool recv_armed;
+	std::vector<struct iovec> send_iovecs;
+
+	/* requests framed but not responded yet, and their frame bytes,
+	 *	reading is paused while they are over the connection limit 
+	*/
+	int inflight_requests;
+	size_t inflight_bytes;
+	bool paused;
+	/* recv is not re-armed, the connection is handed over once idle */
+	bool leaving;
+	/* frames go through the rings of a shared memory segment instead of
+	 *	the handle, which only tells the client has gone, see ClientShm
+	*/
+	ShmSegment *shm;
+};
+
+/* ConnectionTable maps handles to the connections of one reactor by a flat
+ * array indexed by the handle, handles are small dense integers, so lookup
+ * is one index instead of hashing. a slot is 16 bytes, 4 in a cache line.
+ * the generation of a slot changes every time the handle is reused, the
+ * epoll data carries handle and generation, so an event of a closed handle
+ * never reaches the connection which reuses it. only touched by net thread
+*/
+class ConnectionTable {
+public:
+	ConnectionTable() : count(0) {}
+	/* the generation of the inserted handle */
+	uint32_t insert(int handle, Connection* connection) {
+		assert(handle >= 0);
+		if ((size_t)handle >= slots.size())
+			slots.resize(std::max((size_t)handle + 1, slots.size() * 2));
+		Slot& slot = slots[handle];
+		assert(slot.connection == nullptr);
+		slot.connection = connection;
+		/* 0 is left for the handles which are not connections */
+		if (++slot.generation == 0)
+			slot.generation = 1;
+		count++;
+		return slot.generation;
+	}
+	Connection* get(int handle) const {
+		assert(handle >= 0 && (size_t)handle < slots.size() && slots[handle].connection);
+		return slots[handle].connection;
+	}
+	/* nullptr if the handle was closed or reused since key was taken */
+	Connection* find(uint64_t key) const {
+		int handle = (int)(uint32_t)key;
+		uint32_t generation = (uint32_t)(key >> 32);
+		if (handle < 0 || (size_t)handle >= slots.size() ||
+				slots[handle].generation != generation)
+			return nullptr;
+		return slots[handle].connection;
+	}
+	/* handle and generation in one word, for epoll data */
+	uint64_t key(int handle) const {
+		if (handle < 0 || (size_t)handle >= slots.size() || slots[handle].connection == nullptr)
+			return (uint32_t)handle;
+		return (uint64_t)slots[handle].generation << 32 | (uint32_t)handle;
+	}
+	Connection* erase(int handle) {
+		Connection* connection = get(handle);
+		slots[handle].connection = nullptr;
+		count--;
+		return connection;
+	}
+	template<typename F>
+	void for_each(F f) {
+		for (size_t i = 0; i < slots.size(); i++) {
+			if (slots[i].connection != nullptr)
+				f((int)i, slots[i].connection);
+		}
+	}
+	void clear() {
+		for (size_t i = 0; i < slots.size(); i++)
+			slots[i].connection = nullptr;
+		count = 0;
+	}
+	size_t size() const { return count; }
+	static bool is_connection(uint64_t key) { return (key >> 32) != 0; }
+protected:
+	struct alignas(16) Slot {
+		Slot() : connection(nullptr), generation(0) {}
+		Connection* connection;
+		uint32_t generation;
+	};
+	std::vector<Slot> slots;
+	size_t count;
+};
+
+/* ReactorTask is posted to a reactor by Request::post or Request::watch */
+struct ReactorTask {
+	ReactorTask *next_posted;
+	/* -1 for a posted function */
+	int fd;
+	/* posted by unwatch, or a watch whose cancel is sent to io_uring */
+	bool cancel;
+	unsigned int events;
+	uint64_t due_ms;
+	std::function<void(unsigned int)> fn;
+	/* std heap is a max heap, so the earliest is the greatest */
+	static bool later(const ReactorTask* a, const ReactorTask* b) {
+		return a->due_ms > b->due_ms;
+	}
+};
+
+/* Reactor is one I/O event loop, owns an epoll fd, a listen socket
+ * (bound with SO_REUSEPORT when there are more than one reactor), a read
+ * buffer and the connection table of the handles it accepted. 
+ * work threads post matured requests back to the connection of the handle.
+*/
+class Reactor {
+	friend class Server;
+	friend class Connection;
+	friend class Request;
+	friend class Response;
+public:
+	Reactor(Server* server, int index);
+	~Reactor();
+	int get_index() const { return index; }
+protected:
+	bool open(int listen_port);
+	void run();
+	void accept_epoll();
+	/* return nullptr if onConnected refuses the handle */
+	Connection* accept_connection(int handle, const char* client_ip);
+	Connection* create_premature_entry(int handle);
+	Connection* get_connection(int handle);
+	bool read_connection(Connection* connection);
+	/* return false if the handle has been closed */
+	bool parse_frames(Connection* connection, const char* src, int size);
+	/* hand the body in src to onStream, return bytes taken, -1 if refused */
+	int stream_body(Connection* connection, const char* src, int size);
+	bool write_connection(Connection* connection);
+	bool send_file(Connection* connection);
+	/* fill iov with unwritten responses of the connection within write budget,
+	 *	-1 if a streamed response fails
+	*/
+	int gather_responses(Connection* connection, struct iovec* iov, int iov_limit);
+	/* release the responses written completely by size bytes */
+	void consume_responses(Connection* connection, size_t size);
+	void record_stages(Request* request, uint64_t now);
+	/* close and clear the handle, then call onPeerReset or onPeerClosed */
+	void drop_connection(int handle, bool reset);
+	void clear_handle(int handle);
+	void move_premature_request(Connection* connection);
+	void release_remain();
+
+	void close_connection(int handle);
+	void epoll_add_socket(int sock, int op);
+	void epoll_delete_socket(int sock);
+	void epoll_modify_socket(int sock, int op);
+
+	/* called from work thread, wake the reactor for completed requests */
+	void notify_completed(Connection* connection);
+	void flush_notified();
+	/* called from any thread, break the wait of the reactor */
+	void wakeup();
+
+	/* backpressure, see Server::set_connection_limit */
+	bool over_limit(Connection* connection) const;
+	bool can_resume(Connection* connection) const;
+	void finish_request(Connection* connection, Request* request);
+	void pause_connection(Connection* connection);
+	void resume_connection(Connection* connection);
+	/* resume the paused connections after server wide in flight drained */
+	void check_paused();
+
+	/* timeouts, see Server::set_idle_timeout */
+	void run_timers();
+	void check_timeout(Connection* connection);
+	/* the time the connection times out in its state, UINT64_MAX if none */
+	uint64_t timeout_of(Connection* connection) const;
+	int wait_timeout() const;
+
+	/* tasks, see Request::post */
+	void post(std::function<void()> fn, unsigned int delay_ms);
+	void watch(int fd, unsigned int events, std::function<void(unsigned int)> fn);
+	void unwatch(int fd);
+	void post_task(ReactorTask* task);
+	void run_posted();
+	void run_due_tasks();
+	void add_watch(ReactorTask* task);
+	void cancel_watch(int fd);
+	void finish_watch(int fd, unsigned int events);
+
+	/* restart, see Server::set_handoff */
+	void stop_accept();
+	void run_handoff();
+	/* nothing is read, in flight or to write, it can be handed over */
+	bool is_idle(Connection* connection) const;
+	void leave_connection(int handle);
+	void adopt_connection(int handle);
+
+	/* shared memory transport, see Server::set_shm_path */
+	void adopt_shm(int handle);
+	bool read_shm(Connection* connection);
+	bool write_shm(Connection* connection);
+
+#ifdef NEUSC_HAVE_URING
+	bool open_uring();
+	void run_uring();
+	void drain_uring();
+	/* nullptr if the ring can't take an sqe even after its completions
+	 *	are moved to uring_backlog
+	*/
+	struct io_uring_sqe* uring_sqe();
+	/* an operation the ring refused is queued to uring_retry */
+	void uring_accept();
+	void uring_cancel_accept();
+	void uring_wake();
+	void uring_recv(Connection* connection);
+	void uring_send(Connection* connection);
+	/* return false if the ring refused the cancel, the recv goes on */
+	bool uring_cancel_recv(Connection* connection);
+	void retry_uring();
+	void handle_cqe(uint64_t user_data, int res, unsigned flags);
+	void handle_accept(int res, unsigned flags);
+	void handle_recv(Connection* connection, int res, unsigned flags);
+	void handle_send(Connection* connection, int res);
+
+	/* low bits of user_data tell the operation, the rest is the connection,
+	 *	or the fd of a watch to cancel in uring_retry
+	*/
+	enum : uint64_t {
+		URING_RECV = 1,
+		URING_SEND = 2,
+		URING_ACCEPT = 3,
+		URING_WAKE = 4,
+		URING_CANCEL = 5,
+		URING_POLL = 6,
+		URING_TAG_MASK = 7,
+	};
+	constexpr static const unsigned URING_ENTRIES = 1024;
+	constexpr static const unsigned URING_BUFFER_COUNT = 1024;
+	constexpr static const unsigned URING_BUFFER_SIZE = 16 * 1024;
+#endif
+
+	constexpr static const int EVENTSIZE = 1000;
+	/* connections accepted at most per event of the listen socket, it's
+	 *	level triggered, the rest are reported again after other events
+	*/
+	constexpr static const int ACCEPT_BATCH = 256;
+	constexpr static const unsigned int TIMER_TICK_MS = 100;
+	constexpr static const int BUFFERSIZE = 64 * 1024;
+
+	Server *server;
+	int index;
+	int epoll_fd;
+	int listen_fd;
+	struct epoll_event events[EVENTSIZE];
+	char buffer[BUFFERSIZE];
+	std::vector<struct iovec> iovecs;
+
+	ConnectionTable connections;
+	/* responses collected but not yet written */
+	std::atomic<int> wait_send;
+	ReactorMetrics metrics;
+	/* file responses go by sendfile, or by mapping with io_uring */
+	bool use_sendfile;
+	/* time of the current read, 0 unless STAGE_METRICS is set */
+	uint64_t read_ns;
+	/* time of the current loop in ms */
+	uint64_t loop_ms;
+	TimerWheel timers;
+	/* cleared when the listen socket is handed over */
+	bool accepting;
+	/* all connections are handed over, or the drain has timed out */
+	bool handed_off;
+
+	/* eventfd to wake the loop up, work threads link connections with 
+	 *	completed requests to notified_list and write wake_fd only when 
+	 *	the list was empty, the reactor flushes the list in one pass
+	*/
+	int wake_fd;
+	std::atomic<Connection*> notified_list;
+
+	/* tasks are posted to a lock free list from any thread, then wait in
+	 *	a heap by due time, or in watches indexed by fd until it's ready
+	*/
+	std::atomic<ReactorTask*> posted_list;
+	std::vector<ReactorTask*> task_heap;
+	std::vector<ReactorTask*> watches;
+
+	/* connections paused on in flight limits, read by other reactors */
+	std::atomic<int> paused_count;
+	/* set when server wide in flight has drained below the limit */
+	std::atomic<bool> resume_check;
+#ifdef NEUSC_HAVE_URING
+	Uring* uring;
+	bool recv_multishot;
+	/* operations in flight which hold a connection reference */
+	int uring_inflight;
+	uint64_t wake_value;
+	/* completions taken off the ring to make room, handled first */
+	std::vector<struct io_uring_cqe> uring_backlog;
+	/* user_data of the operations to submit again on the next loop,
+	 *	a connection in it holds a reference
+	*/
+	std::vector<uint64_t> uring_retry;
+#endif
+
+	std::thread* thread;
 };
 
 class Server {
+	friend class Reactor;
+	friend class Connection;
 	friend class Request;
 	friend class Response;
 public:
 	enum : unsigned char {
 		RESPONSE_ORDERLY = 1,
+		/* every frame carries a 4 bytes request id after the length,
+		 * the response echoes it, so responses can go out of order
+		 * and client still matches them
+		*/
+		REQUEST_ID = 2,
+		/* time every request through the stages, see Stage in neusc_metrics.h */
+		STAGE_METRICS = 4,
+		/* every handle is hashed to one work thread with its own queue, so
+		 * requests of a connection are handled in order by one thread and 
+		 * its state stays in one cache. idle threads steal from a thread
+		 * with a backlog. it's ignored if onPick or a scheduler is set
+		*/
+		WORKER_AFFINITY = 8,
+		/* call onRequest in the reactor thread as soon as a request is
+		 * framed, and write the responses ended in it after the read, with
+		 * no queue, wakeup or epoll_ctl on the way. for handlers of a few 
+		 * microseconds which never block, see also Request::set_inline
+		*/
+		INLINE_REQUEST = 16,
+	};
+	enum IoBackend {
+		IO_EPOLL,
+		/* multishot accept and recv with provided buffers, writev by sqe,
+		 * falls back to epoll if kernel doesn't support it
+		*/
+		IO_URING,
 	};
 	Server();
+	~Server();
 	int ready(int listen_port, const ServerEvents& on_event);
 	void set_work_thread_count(int c) { work_thread_count = c; }
+
+	/* count of I/O reactors, each runs its own epoll loop in its own thread,
+	 * default is 1, the reactor 0 runs in the thread calling ready()
+	*/
+	void set_io_thread_count(int c) { io_thread_count = c > 0 ? c : 1; }
 	void set_listen_address(const std::string& a) { listen_address = a; }
+
+	/* capacity of the lock free pending ring, default is 64K requests */
+	void set_pending_capacity(size_t c) { pending_capacity = c; }
+
+	/* budget of one writev, responses of a connection are gathered until 
+	 * iov_count iovecs or bytes are reached, default is 64 iovecs and 256K
+	*/
+	void set_write_budget(int iov_count, size_t bytes) {
+		write_iov_count = std::max(2, std::min(iov_count, IOV_MAX));
+		write_bytes = bytes;
+	}
+	/* default is IO_EPOLL */
+	void set_io_backend(IoBackend b) { io_backend = b; }
+	/* options of the listen sockets and the accepted connections, set 
+	 * before ready(). the default only raises the backlog to 1024
+	*/
+	void set_socket_options(const SocketOptions& o) { socket_options = o; }
+	/* caps of requests in flight of one connection, which are framed but 
+	 * not responded yet, and their frame bytes. the reactor stops reading 
+	 * a connection when one is reached, and resumes when it drains below 
+	 * 3/4 of the cap. 0 is unlimited, the default
+	*/
+	void set_connection_limit(int requests, size_t bytes) {
+		connection_limit_requests = requests;
+		connection_limit_bytes = bytes;
+	}
+	/* the same caps over all connections of the server */
+	void set_server_limit(size_t requests, size_t bytes) {
+		server_limit_requests = requests;
+		server_limit_bytes = bytes;
+	}
+	/* close the connection with no request in flight and nothing to read or
+	 * write for ms, 0 is never, the default. so are the timeouts below
+	*/
+	void set_idle_timeout(unsigned int ms) { idle_timeout_ms = ms; }
+	/* close the connection when a frame header doesn't complete in header_ms
+	 * from its first byte, or no more of a frame body is read in body_ms.
+	 * they don't count while reading is paused on in flight limits
+	*/
+	void set_read_timeout(unsigned int header_ms, unsigned int body_ms) {
+		header_timeout_ms = header_ms;
+		body_timeout_ms = body_ms;
+	}
+	/* close the connection when its responses make no progress in ms,
+	 * because the peer doesn't read them
+	*/
+	void set_write_timeout(unsigned int ms) { write_timeout_ms = ms; }
+	/* deadline of a request from it's framed, a request picked after the 
+	 * deadline goes to onExpired instead of onRequest. Request::set_deadline
+	 * in onClassify overrides it
+	*/
+	void set_request_timeout(unsigned int ms) { request_timeout_ms = ms; }
+
+	/* zero downtime restart by the unix socket path. ready() takes over the
+	 * listen sockets of the process serving path if there is one, then it 
+	 * serves path itself. when the next process connects to it, this one
+	 * stops accepting, hands its connections over as they go idle, and 
+	 * exits when all are handed over, or after drain_ms closing the rest.
+	 * requests in flight complete here. a connection handed over gets 
+	 * onPeerClosed here and onConnected there
+	*/
+	void set_handoff(const std::string& path, unsigned int drain_ms = 30000) {
+		handoff_path = path;
+		handoff_drain_ms = drain_ms;
+	}
+
+	/* serve the clients on this host by shared memory, see ClientShm. a
+	 * client connects to the unix socket path and gets a segment with a 
+	 * ring of ring_bytes each way, frames go through the rings instead of
+	 * TCP, the handler API is the same. the connections are spread over
+	 * the reactors, it needs the epoll backend
+	*/
+	void set_shm_path(const std::string& path, size_t ring_bytes = 1024 * 1024) {
+		shm_path = path;
+		shm_ring_bytes = ring_bytes;
+	}
+
+	/* order pending requests by scheduler instead of FIFO, the server takes 
+	 * it and deletes it at last. set before ready()
+	*/
+	void set_scheduler(Scheduler* s) { delete scheduler; scheduler = s; }
+	/* onRequestBatch gets at most max requests, a work thread waits at 
+	 * most linger_us for more after the first one, default is 32 and 0
+	*/
+	void set_request_batch(size_t max, unsigned int linger_us) {
+		request_batch_max = max > 0 ? max : 1;
+		request_batch_linger_us = linger_us;
+	}
+	/* request bodies of this size or more go to onStream if it's set,
+	 * default is 1M
+	*/
+	void set_stream_threshold(size_t bytes) { stream_threshold = bytes > 0 ? bytes : 1; }
 	void set_config_on(unsigned char c) { config |= c; }
 	void set_config_off(unsigned char c) { config &= ~c; }
+	/* counters, queue depths and stage latency of all reactors,
+	 * can be called from any thread while the server runs
+	*/
+	MetricsSnapshot get_metrics();
 	void dump_state();
 	static void prepare_exit();
 
 protected:
-	void thread_process();
-	void create_premature_entry(int handle);
-	Request* get_handle_request(int handle);
-	Response* get_handle_response(int handle);
-	void clear_handle(int handle);
-	void move_premature_request(int handle);
-	Request* move_sending_request(int handle);
+	void thread_process(int index);
+	/* call onRequest for a request picked by work thread or inline */
+	void handle_request(Request* request);
+	/* time the pick and create the response */
+	void begin_request(Request* request);
+	/* return true if the request is past its deadline, it's handed to onExpired */
+	bool expire_request(Request* request);
+	void push_pending(Request* request);
+	/* pick at most max requests, return 0 if server is exiting, or none
+	 *	is pending and wait is false
+	*/
+	size_t pick_pending(int index, Request** requests, size_t max, bool wait);
 	void notify_working();
+
+	/* WORKER_AFFINITY mode */
+	void push_worker(Request* request);
+	size_t pick_worker(int index, Request** requests, size_t max, bool wait);
+	Request* steal_worker(int index);
+	void wake_worker(WorkerQueue* worker);
 	void release_remain();
 
 	void set_non_blocking(int);
-	void close_connection(int handle);
-	void epoll_add_socket(int sock, int op);
-	void epoll_delete_socket(int sock);
-	void epoll_modify_socket(int sock, int op);
+	/* set socket_options on a listen socket, an option which fails is
+	 *	reported and left as it is
+	*/
+	void apply_socket_options(int sock);
 
-	constexpr static const int LISTENQ = 20;
-	constexpr static const int EVENTSIZE = 1000;
-	constexpr static const int BUFFERSIZE = 64 * 1024;
+	/* server wide in flight accounting, only when server limit is set */
+	void add_inflight(size_t bytes);
+	/* return true if in flight has just drained below 3/4 of the limit */
+	bool sub_inflight(size_t requests, size_t bytes);
+	/* over limit, or over 3/4 of limit when low is true */
+	bool over_server_limit(bool low) const;
+	void wake_paused();
+
+	/* restart, see set_handoff */
+	bool take_over();
+	void open_handoff();
+	void accept_handoff();
+	void begin_handoff(int sock);
+	void receive_handoff();
+	/* called from any net thread, never blocks. false if the channel has
+	 *	failed, or with errno EAGAIN if it's full and the fds are to be
+	 *	sent again later
+	*/
+	bool send_handoff(const int* fds, int count);
+	/* called by the last reactor done, exit the server */
+	void end_handoff();
+
+	/* shared memory transport, see set_shm_path */
+	void open_shm();
+	void accept_shm();
+
+	/* times of polling the pending ring before a work thread parks */
+	constexpr static const int PENDING_SPIN = 128;
+	/* a worker is stolen from when this many requests are queued, a single 
+	 *	one is left for the worker itself, which is about to take it
+	*/
+	constexpr static const size_t STEAL_BACKLOG = 2;
 
 	static volatile bool exit_flag;
-	int epoll_fd;
-	struct epoll_event events[EVENTSIZE];
 	struct sockaddr_in server_address;
-	char buffer[BUFFERSIZE];
 	ServerEvents server_events;
 	int work_thread_count;
+	int io_thread_count;
+	int write_iov_count;
+	size_t write_bytes;
+	int connection_limit_requests;
+	size_t connection_limit_bytes;
+	size_t server_limit_requests;
+	size_t server_limit_bytes;
+	std::atomic<size_t> inflight_requests;
+	std::atomic<size_t> inflight_bytes;
+	size_t stream_threshold;
+	size_t request_batch_max;
+	unsigned int request_batch_linger_us;
+	unsigned int idle_timeout_ms;
+	unsigned int header_timeout_ms;
+	unsigned int body_timeout_ms;
+	unsigned int write_timeout_ms;
+	unsigned int request_timeout_ms;
+	/* the shortest connection timeout, 0 if there is none */
+	unsigned int min_timeout_ms() const;
 	std::string listen_address;
 	unsigned char config;
+	IoBackend io_backend;
+	SocketOptions socket_options;
 
-	std::unordered_map<int,Request*> premature_map;
-	std::unordered_map<int,Request*> sending_map;
+	std::vector<Reactor*> reactors;
+	/* pending_ring is used unless onPick or scheduler is set, pending_list
+	 * is also the parking place of work threads waiting on pending_ring
+	*/
+	bool use_pending_ring;
+	Scheduler* scheduler;
+	size_t pending_capacity;
+	PendingRing pending_ring;
+	std::atomic<int> parked_count;
 	PendingList pending_list;
-	MatureList mature_list;
+	/* one per work thread in WORKER_AFFINITY mode, empty otherwise */
+	std::vector<WorkerQueue*> workers;
 
 	std::vector<std::thread*> threads;
+
+	/* restart, see set_handoff */
+	std::string handoff_path;
+	unsigned int handoff_drain_ms;
+	/* listen sockets taken over from the old process */
+	std::vector<int> inherited_fds;
+	/* unix socket waiting for the next process */
+	int handoff_listen_fd;
+	/* channel to the next process, set once it connects */
+	int handoff_fd;
+	std::mutex handoff_mutex;
+	std::atomic<bool> handing_off;
+	/* reactors which still have connections to hand over */
+	std::atomic<int> handoff_left;
+	uint64_t handoff_deadline_ms;
+	/* channel from the old process, connections come by it */
+	int takeover_fd;
+	size_t adopt_next;
+
+	/* shared memory transport, see set_shm_path */
+	std::string shm_path;
+	size_t shm_ring_bytes;
+	int shm_listen_fd;
+	size_t shm_next;
 };
 } // namespace neusc
 
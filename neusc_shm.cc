@@ -0,0 +1,223 @@
+#include "neusc_shm.h"
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace neusc;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+		"shared atomics must be lock free");
+
+namespace {
+/* at the start of the segment, the data of the rings follows */
+struct ShmHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity;
+	ShmRing rings[2];
+};
+const uint32_t SHM_MAGIC = 0x6e657573;
+const size_t HEADER_SIZE = (sizeof(ShmHeader) + 4095) & ~(size_t)4095;
+}
+
+void ShmPipe::init(ShmRing* r, char* d, size_t c) {
+	ring = r;
+	data = d;
+	capacity = c;
+	tail = ring->tail.load(std::memory_order_relaxed);
+	head = ring->head.load(std::memory_order_relaxed);
+	broken = tail - head > capacity;
+}
+
+bool ShmPipe::load_head(uint64_t& h) {
+	h = ring->head.load(std::memory_order_acquire);
+	if (tail - h > capacity)
+		broken = true;
+	return !broken;
+}
+
+bool ShmPipe::load_tail(uint64_t& t) {
+	t = ring->tail.load(std::memory_order_acquire);
+	if (t - head > capacity)
+		broken = true;
+	return !broken;
+}
+
+size_t ShmPipe::copy_in(uint64_t position, const char* buf, size_t size) {
+	assert(size <= capacity);
+	size = std::min(size, capacity);
+	size_t offset = position & (capacity - 1);
+	size_t first = std::min(size, capacity - offset);
+	memcpy(data + offset, buf, first);
+	memcpy(data, buf + first, size - first);
+	return size;
+}
+
+size_t ShmPipe::write(const char* buf, size_t size) {
+	uint64_t h;
+	if (!load_head(h))
+		return 0;
+	size = std::min(size, (size_t)(capacity - (tail - h)));
+	if (size == 0)
+		return 0;
+	tail += copy_in(tail, buf, size);
+	ring->tail.store(tail, std::memory_order_release);
+	return size;
+}
+
+/* publish all iovecs which fit at once */
+size_t ShmPipe::writev(const struct iovec* iov, int count) {
+	uint64_t h;
+	if (!load_head(h))
+		return 0;
+	size_t space = capacity - (tail - h);
+	size_t written = 0;
+	for (int i = 0; i < count && space > 0; i++) {
+		size_t size = std::min(iov[i].iov_len, space);
+		written += copy_in(tail + written, (const char*)iov[i].iov_base, size);
+		space -= size;
+	}
+	if (written > 0) {
+		tail += written;
+		ring->tail.store(tail, std::memory_order_release);
+	}
+	return written;
+}
+
+size_t ShmPipe::space() const {
+	uint64_t h = ring->head.load(std::memory_order_seq_cst);
+	/* a broken head counts as full, write reports it */
+	return tail - h > capacity ? 0 : capacity - (tail - h);
+}
+
+bool ShmPipe::wake_reader() {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return ring->reader_waiting.load(std::memory_order_relaxed) != 0 &&
+		ring->reader_waiting.exchange(0) != 0;
+}
+
+bool ShmPipe::sleep_writer() {
+	ring->writer_waiting.store(1, std::memory_order_seq_cst);
+	if (space() == 0)
+		return true;
+	ring->writer_waiting.store(0, std::memory_order_relaxed);
+	return false;
+}
+
+size_t ShmPipe::peek(const char*& ptr) {
+	uint64_t t;
+	if (!load_tail(t))
+		return 0;
+	size_t offset = head & (capacity - 1);
+	ptr = data + offset;
+	return std::min((size_t)(t - head), capacity - offset);
+}
+
+void ShmPipe::consume(size_t size) {
+	head += size;
+	ring->head.store(head, std::memory_order_release);
+}
+
+bool ShmPipe::empty() const {
+	return ring->tail.load(std::memory_order_seq_cst) == head;
+}
+
+bool ShmPipe::wake_writer() {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	return ring->writer_waiting.load(std::memory_order_relaxed) != 0 &&
+		ring->writer_waiting.exchange(0) != 0;
+}
+
+bool ShmPipe::sleep_reader() {
+	ring->reader_waiting.store(1, std::memory_order_seq_cst);
+	if (empty())
+		return true;
+	ring->reader_waiting.store(0, std::memory_order_relaxed);
+	return false;
+}
+
+ShmSegment::ShmSegment() : memfd(-1), server_efd(-1), client_efd(-1), 
+		base(nullptr), size(0) {
+}
+
+ShmSegment::~ShmSegment() {
+	if (base != nullptr)
+		munmap(base, size);
+	if (memfd >= 0)
+		::close(memfd);
+	if (server_efd >= 0)
+		::close(server_efd);
+	if (client_efd >= 0)
+		::close(client_efd);
+}
+
+bool ShmSegment::create(size_t capacity) {
+	size_t c = 4096;
+	while (c < capacity)
+		c <<= 1;
+	memfd = memfd_create("neusc_shm", MFD_CLOEXEC);
+	if (memfd < 0) {
+		perror("memfd_create");
+		return false;
+	}
+	if (ftruncate(memfd, HEADER_SIZE + c * 2) < 0) {
+		perror("ftruncate");
+		return false;
+	}
+	server_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	client_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (server_efd < 0 || client_efd < 0) {
+		perror("eventfd");
+		return false;
+	}
+	return map(c, true);
+}
+
+bool ShmSegment::attach(int m, int s, int c) {
+	memfd = m;
+	server_efd = s;
+	client_efd = c;
+	struct stat st;
+	if (fstat(memfd, &st) < 0 || (size_t)st.st_size <= HEADER_SIZE) {
+		errno = EPROTO;
+		return false;
+	}
+	return map((st.st_size - HEADER_SIZE) / 2, false);
+}
+
+bool ShmSegment::map(size_t capacity, bool init) {
+	size = HEADER_SIZE + capacity * 2;
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	base = p;
+	ShmHeader* header = (ShmHeader*)base;
+	if (init) {
+		/* the file is zero filled, so are the positions and flags */
+		header->magic = SHM_MAGIC;
+		header->version = 1;
+		header->capacity = capacity;
+	} else if (header->magic != SHM_MAGIC || header->capacity != capacity ||
+			(capacity & (capacity - 1)) != 0) {
+		errno = EPROTO;
+		return false;
+	}
+	char* data = (char*)base + HEADER_SIZE;
+	requests.init(&header->rings[0], data, capacity);
+	responses.init(&header->rings[1], data + capacity, capacity);
+	return true;
+}
+
+void ShmSegment::signal(int efd) {
+	uint64_t one = 1;
+	if (::write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("write eventfd");
+}
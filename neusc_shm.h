@@ -0,0 +1,104 @@
+#ifndef __NEUSC_SHM_H_
+#define __NEUSC_SHM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <sys/uio.h>
+
+namespace neusc {
+
+/* ShmRing is the shared state of one single producer single consumer byte
+ * ring, positions only grow. a side about to sleep sets its waiting flag
+ * and checks the ring again, the other side clears the flag and signals
+ * its eventfd, so there is no syscall while both sides are busy
+*/
+struct ShmRing {
+	alignas(64) std::atomic<uint64_t> tail;
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint32_t> reader_waiting;
+	alignas(64) std::atomic<uint32_t> writer_waiting;
+};
+
+/* ShmPipe is one side's view of a ShmRing and its data. frames go through
+ * it as a byte stream in the same format as TCP, so a frame may be larger
+ * than the ring. the position a side moves is kept here, only the one of
+ * the other side is loaded from shared memory, and it's checked, a peer
+ * writing the ring state wrongly makes the pipe broken, never a copy out
+ * of the ring
+*/
+class ShmPipe {
+public:
+	ShmPipe() : ring(nullptr), data(nullptr), capacity(0), tail(0), head(0), broken(false) {}
+	void init(ShmRing* r, char* d, size_t c);
+	/* the other side has broken the positions, the pipe is unusable */
+	bool is_broken() const { return broken; }
+
+	/* producer, return the bytes written, 0 if the ring is full or broken */
+	size_t write(const char* buf, size_t size);
+	size_t writev(const struct iovec* iov, int count);
+	size_t space() const;
+	/* return true if the reader sleeps, it must be signaled */
+	bool wake_reader();
+	/* return true if the writer should sleep, the ring is still full */
+	bool sleep_writer();
+
+	/* consumer, ptr is set to the readable bytes which are contiguous,
+	 *	0 if the ring is empty or broken
+	*/
+	size_t peek(const char*& ptr);
+	void consume(size_t size);
+	bool empty() const;
+	/* return true if the writer waits for space, it must be signaled */
+	bool wake_writer();
+	/* return true if the reader should sleep, the ring is still empty */
+	bool sleep_reader();
+
+protected:
+	size_t copy_in(uint64_t position, const char* buf, size_t size);
+	/* the head of the consumer, or the tail of the producer, false and
+	 *	broken if it's out of the capacity
+	*/
+	bool load_head(uint64_t& h);
+	bool load_tail(uint64_t& t);
+
+	ShmRing* ring;
+	char* data;
+	/* power of 2 */
+	size_t capacity;
+	/* own position of the producer or consumer, published to ring */
+	uint64_t tail;
+	uint64_t head;
+	bool broken;
+};
+
+/* ShmSegment is a memfd with the ring of requests from client to server and
+ * the ring of responses back, with an eventfd to wake each side. the server
+ * creates it and passes memfd and eventfds to the client with SCM_RIGHTS
+*/
+class ShmSegment {
+public:
+	ShmSegment();
+	~ShmSegment();
+	/* server, capacity of each ring is rounded up to a power of 2 */
+	bool create(size_t capacity);
+	/* client, takes the fds */
+	bool attach(int memfd, int server_efd, int client_efd);
+	static void signal(int efd);
+
+	ShmPipe requests;
+	ShmPipe responses;
+	int memfd;
+	/* written by client to wake server, and by server to wake client */
+	int server_efd;
+	int client_efd;
+protected:
+	bool map(size_t capacity, bool init);
+
+	void* base;
+	size_t size;
+};
+
+} // namespace neusc
+
+#endif
@@ -0,0 +1,102 @@
+#include "neusc_timer.h"
+
+using namespace neusc;
+
+TimerWheel::TimerWheel() : current(0), tick_ms(1), count(0) {
+	for (int l = 0; l < LEVELS; l++) {
+		for (int i = 0; i < SLOT_COUNT; i++) {
+			slots[l][i].prev = &slots[l][i];
+			slots[l][i].next = &slots[l][i];
+		}
+	}
+}
+
+void TimerWheel::init(uint64_t now_ms, unsigned int tick) {
+	tick_ms = tick > 0 ? tick : 1;
+	current = now_ms / tick_ms;
+}
+
+void TimerWheel::add(Timer* timer, uint64_t expire_ms) {
+	if (timer->is_armed())
+		remove(timer);
+	/* round up, a timer never fires early */
+	timer->expire = (expire_ms + tick_ms - 1) / tick_ms;
+	link(timer);
+	count++;
+}
+
+void TimerWheel::remove(Timer* timer) {
+	if (!timer->is_armed())
+		return;
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = nullptr;
+	timer->next = nullptr;
+	count--;
+}
+
+/*
+ * the level is chosen by the distance to current, a timer beyond the
+ * last level waits in its last slot and is placed again when it cascades
+*/
+void TimerWheel::link(Timer* timer) {
+	uint64_t expire = timer->expire < current ? current : timer->expire;
+	uint64_t delta = expire - current;
+	int level = 0;
+	while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1))))
+		level++;
+	if (delta >= ((uint64_t)1 << (SLOT_BITS * LEVELS)))
+		expire = current + ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;
+	Timer* head = &slots[level][(expire >> (SLOT_BITS * level)) & (SLOT_COUNT - 1)];
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+/* move the timers of a slot to lower levels */
+void TimerWheel::cascade(int level, int index) {
+	Timer* head = &slots[level][index];
+	Timer* timer = head->next;
+	head->prev = head;
+	head->next = head;
+	while (timer != head) {
+		Timer* next = timer->next;
+		link(timer);
+		timer = next;
+	}
+}
+
+Timer* TimerWheel::advance(uint64_t now_ms) {
+	uint64_t now = now_ms / tick_ms;
+	/* nothing to fire or cascade, jump instead of walking the idle ticks */
+	if (count == 0) {
+		if (current <= now)
+			current = now + 1;
+		return nullptr;
+	}
+	Timer* expired = nullptr;
+	Timer** tail = &expired;
+	while (current <= now) {
+		/* wrap of a level brings down the next slot of the level above */
+		for (int level = 1; level < LEVELS; level++) {
+			if ((current & (((uint64_t)1 << (SLOT_BITS * level)) - 1)) != 0)
+				break;
+			cascade(level, (current >> (SLOT_BITS * level)) & (SLOT_COUNT - 1));
+		}
+		Timer* head = &slots[0][current & (SLOT_COUNT - 1)];
+		Timer* timer = head->next;
+		while (timer != head) {
+			Timer* next = timer->next;
+			if (timer->expire <= current) {
+				remove(timer);
+				*tail = timer;
+				tail = &timer->next;
+			}
+			timer = next;
+		}
+		current++;
+	}
+	*tail = nullptr;
+	return expired;
+}
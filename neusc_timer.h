@@ -0,0 +1,62 @@
+#ifndef __NEUSC_TIMER_H_
+#define __NEUSC_TIMER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace neusc {
+
+/* Timer is linked into a TimerWheel by its owner, which is never copied
+ * while the timer is armed
+*/
+struct Timer {
+	Timer() : prev(nullptr), next(nullptr), expire(0), owner(nullptr) {}
+	bool is_armed() const { return prev != nullptr; }
+
+	Timer *prev;
+	Timer *next;
+	/* in ticks */
+	uint64_t expire;
+	void *owner;
+};
+
+/* TimerWheel is a hierarchical timing wheel, LEVELS wheels of SLOT_COUNT
+ * slots, each slot of a level spans a whole turn of the level below.
+ * timers are linked in the slot of their expire tick, and moved down a
+ * level when the lower wheel wraps. add, remove and firing are O(1), a
+ * timer is moved at most LEVELS - 1 times. owned by one thread.
+*/
+class TimerWheel {
+public:
+	constexpr static const int SLOT_BITS = 8;
+	constexpr static const int SLOT_COUNT = 1 << SLOT_BITS;
+	constexpr static const int LEVELS = 4;
+
+	TimerWheel();
+	/* ticks are tick_ms long, counted from now_ms */
+	void init(uint64_t now_ms, unsigned int tick_ms);
+	/* arm or re-arm timer to expire at expire_ms */
+	void add(Timer* timer, uint64_t expire_ms);
+	void remove(Timer* timer);
+	/* advance to now_ms, return the expired timers linked by next,
+	 *	they are disarmed. an empty wheel jumps to now_ms in O(1)
+	*/
+	Timer* advance(uint64_t now_ms);
+	size_t size() const { return count; }
+	unsigned int get_tick_ms() const { return tick_ms; }
+
+protected:
+	void link(Timer* timer);
+	void cascade(int level, int index);
+
+	/* every slot is a circular list with a sentinel head */
+	Timer slots[LEVELS][SLOT_COUNT];
+	/* the next tick to process */
+	uint64_t current;
+	unsigned int tick_ms;
+	size_t count;
+};
+
+} // namespace neusc
+
+#endif
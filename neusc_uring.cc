@@ -0,0 +1,238 @@
+#include "neusc_uring.h"
+
+#ifdef NEUSC_HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace neusc;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags, void* arg, size_t argsz) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, arg, argsz);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Uring::Uring() : ring_fd(-1), features(0), sq_ptr(nullptr), sq_size(0),
+		sqes(nullptr), sqes_size(0), sqe_tail(0), sq_entries(0),
+		cq_ptr(nullptr), cq_size(0), buf_ring(nullptr), buf_ring_size(0),
+		buffers(nullptr), buffer_count(0), buffer_size(0) {
+}
+
+Uring::~Uring() {
+	if (buffers)
+		munmap(buffers, (size_t)buffer_count * buffer_size);
+	if (buf_ring)
+		munmap(buf_ring, buf_ring_size);
+	if (sqes)
+		munmap(sqes, sqes_size);
+	if (sq_ptr)
+		munmap(sq_ptr, sq_size);
+	if (ring_fd >= 0)
+		::close(ring_fd);
+}
+
+/*
+ * the reactor needs single mmap, no dropping cqe, wait with timeout,
+ * and accept / recv / writev / read opcodes
+*/
+bool Uring::init(unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 4;
+	ring_fd = io_uring_setup(entries, &params);
+	if (ring_fd < 0)
+		return false;
+	features = params.features;
+	unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if ((features & needed) != needed) {
+		::close(ring_fd);
+		ring_fd = -1;
+		return false;
+	}
+
+	/* sq and cq rings share one mapping */
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > sq_size)
+		sq_size = cq_size;
+	cq_size = sq_size;
+	sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED) {
+		sq_ptr = nullptr;
+		::close(ring_fd);
+		ring_fd = -1;
+		return false;
+	}
+	cq_ptr = sq_ptr;
+	char* sq = (char*)sq_ptr;
+	sq_head = (unsigned*)(sq + params.sq_off.head);
+	sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	sq_array = (unsigned*)(sq + params.sq_off.array);
+	sq_entries = params.sq_entries;
+	char* cq = (char*)cq_ptr;
+	cq_head = (unsigned*)(cq + params.cq_off.head);
+	cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		sqes = nullptr;
+		munmap(sq_ptr, sq_size);
+		sq_ptr = nullptr;
+		::close(ring_fd);
+		ring_fd = -1;
+		return false;
+	}
+	/* sqe index is mapped to the same slot of array */
+	for (unsigned i = 0; i < sq_entries; i++)
+		sq_array[i] = i;
+	sqe_tail = *sq_tail;
+
+	/* probe opcodes */
+	size_t probe_size = sizeof(struct io_uring_probe) +
+		256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probe_size);
+	bool supported = io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_WRITEV, IORING_OP_READ };
+	for (size_t i = 0; supported && i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (ops[i] > probe->last_op ||
+				!(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			supported = false;
+	}
+	free(probe);
+	if (!supported) {
+		munmap(sqes, sqes_size);
+		sqes = nullptr;
+		munmap(sq_ptr, sq_size);
+		sq_ptr = nullptr;
+		::close(ring_fd);
+		ring_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+struct io_uring_sqe* Uring::get_sqe() {
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (sqe_tail - head >= sq_entries) {
+		submit(0, 0);
+		head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if (sqe_tail - head >= sq_entries)
+			return nullptr;
+	}
+	struct io_uring_sqe* sqe = &sqes[sqe_tail & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe_tail++;
+	return sqe;
+}
+
+int Uring::submit(unsigned wait_nr, int timeout_ms) {
+	unsigned to_submit = sqe_tail - *sq_tail;
+	__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+	unsigned flags = 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	void* argp = nullptr;
+	size_t argsz = 0;
+	if (wait_nr > 0) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+			memset(&arg, 0, sizeof(arg));
+			arg.sigmask_sz = _NSIG / 8;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+			flags |= IORING_ENTER_EXT_ARG;
+			argp = &arg;
+			argsz = sizeof(arg);
+		}
+	}
+	if (to_submit == 0 && wait_nr == 0)
+		return 0;
+	int ret = io_uring_enter(ring_fd, to_submit, wait_nr, flags, argp, argsz);
+	return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe* Uring::peek_cqe() {
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return nullptr;
+	return &cqes[head & *cq_mask];
+}
+
+void Uring::cqe_seen() {
+	__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * register a ring of count buffers with size bytes each, count must be
+ * power of 2, recv picks buffers from it by IOSQE_BUFFER_SELECT
+*/
+bool Uring::setup_buffers(unsigned count, unsigned size) {
+	long page = sysconf(_SC_PAGESIZE);
+	buf_ring_size = (count * sizeof(struct io_uring_buf) + page - 1) / page * page;
+	void* ring = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+		return false;
+	buf_ring = (struct io_uring_buf_ring*)ring;
+	void* data = mmap(nullptr, (size_t)count * size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED) {
+		munmap(buf_ring, buf_ring_size);
+		buf_ring = nullptr;
+		return false;
+	}
+	buffers = (char*)data;
+	buffer_count = count;
+	buffer_size = size;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+	reg.ring_entries = count;
+	reg.bgid = BUFFER_GROUP;
+	if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return false;
+
+	buf_ring->tail = 0;
+	for (unsigned i = 0; i < count; i++)
+		recycle_buffer(i);
+	return true;
+}
+
+void Uring::recycle_buffer(unsigned short bid) {
+	unsigned short tail = buf_ring->tail;
+	/* not buf_ring->bufs, the flex array is misplaced when compiled as C++ */
+	struct io_uring_buf* buf = reinterpret_cast<struct io_uring_buf*>(buf_ring) +
+		(tail & (buffer_count - 1));
+	buf->addr = (uint64_t)(uintptr_t)get_buffer(bid);
+	buf->len = buffer_size;
+	buf->bid = bid;
+	__atomic_store_n(&buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+#endif // NEUSC_HAVE_URING
@@ -0,0 +1,89 @@
+#ifndef __NEUSC_URING_H_
+#define __NEUSC_URING_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NEUSC_HAVE_URING 1
+#endif
+#endif
+
+#ifdef NEUSC_HAVE_URING
+#include <linux/io_uring.h>
+
+namespace neusc {
+
+/* Uring is a thin wrapper of one io_uring instance by raw syscalls,
+ * it maps the submission and completion rings, hands out sqe, submits
+ * and waits with timeout, and keeps one provided buffer ring for recv.
+ * it's used by one reactor thread only.
+*/
+class Uring {
+public:
+	Uring();
+	~Uring();
+
+	/* return false if kernel doesn't support what the reactor needs,
+	 * caller should fall back to epoll
+	*/
+	bool init(unsigned entries);
+	bool is_ready() const { return ring_fd >= 0; }
+
+	/* return a zeroed sqe, submit queued sqes first if the ring is full */
+	struct io_uring_sqe* get_sqe();
+
+	/* submit queued sqes, wait at least wait_nr completions or timeout,
+	 * return -errno on error
+	*/
+	int submit(unsigned wait_nr, int timeout_ms);
+
+	/* return nullptr if no completion, cqe_seen must be called after use */
+	struct io_uring_cqe* peek_cqe();
+	void cqe_seen();
+
+	/* provided buffers for recv, the group id is BUFFER_GROUP */
+	bool setup_buffers(unsigned count, unsigned size);
+	char* get_buffer(unsigned short bid) { return buffers + (size_t)bid * buffer_size; }
+	void recycle_buffer(unsigned short bid);
+
+	constexpr static const unsigned short BUFFER_GROUP = 0;
+
+protected:
+	int ring_fd;
+	unsigned features;
+
+	/* submission ring */
+	void* sq_ptr;
+	size_t sq_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned sqe_tail;
+	unsigned sq_entries;
+
+	/* completion ring */
+	void* cq_ptr;
+	size_t cq_size;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	/* provided buffer ring */
+	struct io_uring_buf_ring* buf_ring;
+	size_t buf_ring_size;
+	char* buffers;
+	unsigned buffer_count;
+	unsigned buffer_size;
+};
+
+} // namespace neusc
+
+#endif // NEUSC_HAVE_URING
+
+#endif
@@ -0,0 +1,50 @@
+#include "neusc_coro.h"
+#include <iostream>
+#include <cstdlib>
+
+using namespace neusc;
+using namespace std;
+
+const int PORT = 23456;
+
+/* echo server with coroutine handlers, each request waits DELAY_MS as if it
+ * called a slow service, 2 work threads keep thousands of them in flight.
+ * with an upstream "server_coro host port", the request is forwarded there
+ * and its response is echoed
+*/
+const unsigned int DELAY_MS = 10;
+
+int main(int argc, char* argv[]) {
+	Server* server = new Server();
+	server->set_listen_address("0.0.0.0");
+	server->set_work_thread_count(2);
+	server->set_config_on(Server::RESPONSE_ORDERLY);
+
+	ClientAsync* upstream = nullptr;
+	int conn = -1;
+	if (argc == 3) {
+		upstream = new ClientAsync();
+		upstream->start();
+		conn = upstream->connect(argv[1], atoi(argv[2]), 10);
+	}
+
+	ServerEvents events;
+	events.onRequest = async_handler([upstream, conn](Request* request) -> Task<bool> {
+		string reply(request->get_ptr(), request->get_size());
+		request->release_request_data();
+		if (upstream != nullptr) {
+			CallResult result = co_await call(*upstream, conn, request, reply);
+			if (!result.ok)
+				co_return false;
+			reply = std::move(result.data);
+		} else
+			co_await sleep_for(request, DELAY_MS);
+		request->clone_response(reply.size(), reply.data());
+		request->end_response();
+		co_return true;
+	});
+
+	cout << "server start @" << PORT << endl;
+	server->ready(PORT, events);
+	delete upstream;
+}
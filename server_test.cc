@@ -12,7 +12,10 @@ int main () {
 	server->set_listen_address("0.0.0.0");
 
 	//server->set_work_thread_count(4);
+	//server->set_io_thread_count(4);
+	//server->set_io_backend(Server::IO_URING);
 	//server->set_config_on(Server::RESPONSE_ORDERLY);
+	//server->set_shm_path("/tmp/neusc.shm");
 
 	ServerEvents events = {
 		.onInit = [](Server* s) {